@@ -0,0 +1,407 @@
+/* Edit-trace benchmarks for gbf.h.
+ *
+ * Replays synthetic traces (typing, random inserts, paste bursts, cursor
+ * ping-pong, whole-file load/save) over buffers of several sizes and prints
+ * ops/sec, bytes memmoved and reallocs (from buf_stats, so build with
+ * BUF_USE_STATS), per-op latency percentiles and how far the resident set
+ * peaked above its size at the start of the run (VmHWM, reset through
+ * /proc/self/clear_refs, so Linux only and 0 elsewhere).
+ * BUF_INIT_SIZE is a compile-time knob, `make bench` builds one binary per
+ * value in BENCH_INIT_SIZES.
+ *
+ * A recorded trace can be replayed with -t FILE, one op per line:
+ *   i POS LEN   insert LEN bytes at POS
+ *   d POS LEN   delete LEN bytes at POS
+ *   c POS       move the cursor to POS
+ *
+ * Run with -h for the options. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gbf.h"
+
+typedef struct {
+    const char *name;
+    uint64_t *lat;
+    size_t nlat;
+    long rss0; /* resident kB at run_begin() */
+    long peak; /* ...and the most it reached until run_end() */
+} Run;
+
+static size_t nops = 100000;
+static uint8_t filler[1 << 16];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* xorshift, so runs are repeatable */
+static uint64_t rng = 88172645463325252ull;
+static size_t rnd(size_t n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return n ? rng % n : 0;
+}
+
+/* a kB field of /proc/self/status: VmRSS now, VmHWM the peak since the
+ * last rss_reset_peak() */
+static long rss_kb(const char *key)
+{
+    FILE *f;
+    char line[128];
+    size_t n = strlen(key);
+    long kb = 0;
+
+    if (!(f = fopen("/proc/self/status", "r")))
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, key, n) && line[n] == ':') {
+            kb = strtol(line + n + 1, NULL, 10);
+            break;
+        }
+    fclose(f);
+    return kb;
+}
+
+/* restart VmHWM from the current resident set (Linux 4.0+), so it is the
+ * peak of this run rather than of the process */
+static void rss_reset_peak(void)
+{
+    FILE *f;
+
+    if ((f = fopen("/proc/self/clear_refs", "w"))) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+static void run_begin(Run *r, const char *name, size_t ops)
+{
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->lat = malloc(ops * sizeof(*r->lat));
+    if (!r->lat) {
+        perror("malloc");
+        exit(1);
+    }
+    buf_stats_reset();
+    rss_reset_peak();
+    r->rss0 = rss_kb("VmRSS");
+}
+
+/* while the trace's buffer is still alive */
+static void run_end(Run *r)
+{
+    r->peak = rss_kb("VmHWM");
+}
+
+static void op_insert(Run *r, Buffer *b, size_t pos, size_t n)
+{
+    uint64_t t;
+
+    t = now_ns();
+    buf_insert(b, pos, filler, n);
+    r->lat[r->nlat++] = now_ns() - t;
+}
+
+static void op_delete(Run *r, Buffer *b, size_t pos, size_t n)
+{
+    uint64_t t;
+
+    t = now_ns();
+    if (buf_cursor_set(b, pos))
+        buf_delete(b, n);
+    r->lat[r->nlat++] = now_ns() - t;
+}
+
+static void op_cursor(Run *r, Buffer *b, size_t pos)
+{
+    uint64_t t;
+
+    t = now_ns();
+    buf_cursor_set(b, pos);
+    r->lat[r->nlat++] = now_ns() - t;
+}
+
+static void fill(Buffer *b, size_t size)
+{
+    size_t n;
+
+    buf_new(b);
+    for (; size; size -= n) {
+        n = size < sizeof(filler) ? size : sizeof(filler);
+        buf_cat(b, filler, n);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* traces */
+static void trace_typing(Run *r, size_t size)
+{
+    Buffer b;
+    size_t i, pos;
+
+    fill(&b, size);
+    run_begin(r, "typing", nops);
+    pos = size / 2;
+    for (i = 0; i < nops; ++i) {
+        if (i % 8 == 7) {
+            op_delete(r, &b, pos - 1, 1);
+            --pos;
+        } else {
+            op_insert(r, &b, pos++, 1);
+        }
+    }
+    run_end(r);
+    buf_free(&b);
+}
+
+static void trace_random(Run *r, size_t size)
+{
+    Buffer b;
+    size_t i, n;
+
+    /* every op moves the gap ~len/3, keep the run short */
+    fill(&b, size);
+    n = nops / 100 ? nops / 100 : 1;
+    run_begin(r, "random", n);
+    for (i = 0; i < n; ++i)
+        op_insert(r, &b, rnd(buf_len(&b) + 1), 1 + rnd(16));
+    run_end(r);
+    buf_free(&b);
+}
+
+static void trace_paste(Run *r, size_t size)
+{
+    Buffer b;
+    size_t i, n;
+
+    fill(&b, size);
+    n = nops / 1000 ? nops / 1000 : 1;
+    run_begin(r, "paste", n);
+    for (i = 0; i < n; ++i)
+        op_insert(r, &b, rnd(buf_len(&b) + 1), 4096 + rnd(sizeof(filler) - 4096));
+    run_end(r);
+    buf_free(&b);
+}
+
+static void trace_pingpong(Run *r, size_t size)
+{
+    Buffer b;
+    size_t i, n;
+
+    /* the worst case: every op moves the whole text across the gap */
+    fill(&b, size);
+    n = nops / 100 ? nops / 100 : 1;
+    run_begin(r, "pingpong", n);
+    for (i = 0; i < n; ++i)
+        op_insert(r, &b, i % 2 ? buf_len(&b) : 0, 1);
+    run_end(r);
+    buf_free(&b);
+}
+
+static void trace_load_save(Run *r, size_t size)
+{
+    Buffer b, l;
+    uint8_t blk[1 << 16];
+    char path[] = "/tmp/gbf-bench.XXXXXX";
+    uint64_t t;
+    ssize_t n;
+    off_t off;
+    int fd, i, reps = 8;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(path);
+    fill(&b, size);
+    run_begin(r, "load+save", reps * 2);
+    for (i = 0; i < reps; ++i) {
+        t = now_ns();
+        if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0
+                || !buf_write_fd(&b, fd, 0, 0))
+            perror("save");
+        r->lat[r->nlat++] = now_ns() - t;
+
+        /* read it back the way an editor would, a block at a time */
+        t = now_ns();
+        buf_new(&l);
+        for (off = 0; (n = pread(fd, blk, sizeof(blk), off)) > 0; off += n)
+            buf_cat(&l, blk, n);
+        if (n < 0 || buf_len(&l) != size)
+            perror("load");
+        r->lat[r->nlat++] = now_ns() - t;
+        if (i == reps - 1)
+            run_end(r);
+        buf_free(&l);
+    }
+    buf_free(&b);
+    close(fd);
+}
+
+/* recorded trace, see the top of this file */
+static void trace_file(Run *r, const char *path)
+{
+    FILE *f;
+    Buffer b;
+    char op;
+    size_t pos, n, cap;
+
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+    /* one latency per op_*() call: inserts go in sizeof(filler) pieces */
+    for (cap = 0; fscanf(f, " %c %zu", &op, &pos) == 2;) {
+        if (op != 'c' && fscanf(f, "%zu", &n) != 1)
+            break;
+        cap += op == 'i' ? (n + sizeof(filler) - 1) / sizeof(filler) : 1;
+    }
+    rewind(f);
+
+    buf_new(&b);
+    run_begin(r, path, cap);
+    while (fscanf(f, " %c %zu", &op, &pos) == 2) {
+        if (op != 'c' && fscanf(f, "%zu", &n) != 1)
+            break;
+        if (pos > buf_len(&b))
+            pos = buf_len(&b);
+        switch (op) {
+        case 'i':
+            for (; n > sizeof(filler); n -= sizeof(filler), pos += sizeof(filler))
+                op_insert(r, &b, pos, sizeof(filler));
+            if (n)
+                op_insert(r, &b, pos, n);
+            break;
+        case 'd':
+            if (n > buf_len(&b) - pos)
+                n = buf_len(&b) - pos;
+            op_delete(r, &b, pos, n);
+            break;
+        default:
+            op_cursor(r, &b, pos);
+            break;
+        }
+    }
+    fclose(f);
+    run_end(r);
+    buf_free(&b);
+}
+
+/* ------------------------------------------------------------------------- */
+static int cmp_u64(const void *x, const void *y)
+{
+    uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+    return a < b ? -1 : a > b;
+}
+
+static void report(Run *r, size_t size)
+{
+    buf_stats st;
+    uint64_t total;
+    size_t i;
+
+    buf_stats_get(&st);
+    for (total = 0, i = 0; i < r->nlat; ++i)
+        total += r->lat[i];
+    qsort(r->lat, r->nlat, sizeof(*r->lat), cmp_u64);
+
+    printf("%-10s %10zu %8d %8zu %12.0f %12.1f %8llu %10llu %10llu %10.1f\n",
+            r->name, size, BUF_INIT_SIZE, r->nlat,
+            total ? r->nlat / (total / 1e9) : 0.0,
+            st.memmove_bytes / 1048576.0,
+            (unsigned long long)st.reallocs,
+            (unsigned long long)(r->nlat ? r->lat[r->nlat / 2] : 0),
+            (unsigned long long)(r->nlat ? r->lat[r->nlat * 99 / 100] : 0),
+            r->peak > r->rss0 ? (r->peak - r->rss0) / 1024.0 : 0.0);
+    free(r->lat);
+}
+
+/* 64K, 1M, 2G... */
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t n;
+
+    n = strtoul(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; /* fallthrough */
+    case 'M': case 'm': n <<= 10; /* fallthrough */
+    case 'K': case 'k': n <<= 10;
+    }
+    return n;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-n OPS] [-s SIZE]... [-t TRACE]\n"
+            "  -n OPS    ops per local trace, random and pingpong run\n"
+            "            OPS/100, paste OPS/1000 (default 100000)\n"
+            "  -s SIZE   initial buffer size, repeatable (default 64K 1M 16M)\n"
+            "  -t TRACE  replay a recorded trace instead\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static void (*traces[])(Run *, size_t) = {
+        trace_typing, trace_random, trace_paste, trace_pingpong, trace_load_save,
+    };
+    size_t sizes[16] = { 64 << 10, 1 << 20, 16 << 20 };
+    size_t nsizes = 3, i, j;
+    const char *trace = NULL;
+    int c, user_sizes = 0;
+    Run r;
+
+    while ((c = getopt(argc, argv, "n:s:t:h")) != -1) {
+        switch (c) {
+        case 'n':
+            nops = parse_size(optarg);
+            break;
+        case 's':
+            if (!user_sizes++)
+                nsizes = 0;
+            if (nsizes < sizeof(sizes) / sizeof(*sizes))
+                sizes[nsizes++] = parse_size(optarg);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return c != 'h';
+        }
+    }
+
+    for (i = 0; i < sizeof(filler); ++i)
+        filler[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+
+    printf("%-10s %10s %8s %8s %12s %12s %8s %10s %10s %10s\n",
+            "trace", "size", "init", "ops", "ops/s", "moved MB", "reallocs",
+            "p50 ns", "p99 ns", "+peak MB");
+    if (trace) {
+        trace_file(&r, trace);
+        report(&r, 0);
+        return 0;
+    }
+    for (i = 0; i < nsizes; ++i) {
+        for (j = 0; j < sizeof(traces) / sizeof(*traces); ++j) {
+            traces[j](&r, sizes[i]);
+            report(&r, sizes[i]);
+        }
+    }
+    return 0;
+}
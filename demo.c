@@ -7,6 +7,7 @@
  *  Run with -h or --help for the motions*/
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -31,16 +32,28 @@
 #define ESC     0x1b
 #define BACKSPACE 0x7f
 
+/* lines up to this many bytes are edited on the stack */
+#define LINE_INLINE 256
+
 typedef struct {
     int size;
     char *data;
     int size_allocated;
 } CString;
 
+/* input is read a chunk at a time, keys are taken from here */
+typedef struct {
+    unsigned char buf[4096];
+    size_t pos;
+    size_t len;
+} Input;
+
 typedef struct {
     const char *prompt;
     char *dst;
     size_t dst_sz;
+    size_t cols; /* codepoints on screen after the prompt */
+    Input in;
     Buffer gbf;
 } State;
 
@@ -160,6 +173,8 @@ void cstr_free(CString *cstr)
 /* terminal handling */
 static void rawmode_end(void)
 {
+    if (write(1, "\x1b[?2004l", 8) < 0) /* bracketed paste off */
+        perror("write");
     tcsetattr(0, TCSAFLUSH, &term);
 }
 
@@ -178,54 +193,97 @@ int rawmode_start(void)
     atexit(rawmode_end);
     if (tcsetattr(0, TCSAFLUSH, &raw) < 0)
         return -1;
+    /* bracketed paste: pastes come between ESC[200~ and ESC[201~ */
+    if (write(1, "\x1b[?2004h", 8) < 0)
+        return -1;
     return 1;
 }
 
-/* clear the screen and move to top left */
+/* clear the screen and move to top left, the gap goes on the first row */
 int clear_screen(void)
 {
+#ifdef GAP_DEBUG
+    return write(1, "\x1b[2J\x1b[H\n", 8);
+#else
     return write(1, "\x1b[2J\x1b[H", 7);
+#endif
+}
+
+static void cstr_text(CString *cstr, Buffer *gbf, size_t pos, size_t n)
+{
+    buf_slice bs[2];
+
+    if (n && buf_view(gbf, pos, n, bs)) {
+        cstr_cat(cstr, (const char *)bs[0].ptr, bs[0].len);
+        if (bs[1].len)
+            cstr_cat(cstr, (const char *)bs[1].ptr, bs[1].len);
+    }
 }
 
-/* TODO: handle resizing and when length is larger than terminal columns.*/
+/* columns are counted in codepoints */
+#ifndef BUF_USE_UTF8
+#error "redraw() needs BUF_USE_UTF8, see LIBFLAGS in the Makefile"
+#endif
+
+/* TODO: handle resizing and when length is larger than terminal columns.
+ * Only the columns an edit touched are written: characters after it are
+ * shifted by the terminal (ICH/DCH), so a keystroke costs the size of
+ * the edit, not of the line. Without BUF_USE_DAMAGE the line is
+ * rewritten every time. */
 int redraw(void)
 {
     CString cstr;
     Buffer *gbf;
+#ifdef BUF_USE_DAMAGE
+    buf_change d;
+    size_t icols, dcols, cols;
+#endif
+    size_t col;
 
     gbf = &state.gbf;
     cstr_new(&cstr);
     /* gap visualization is avaiable only when compiled with this flag
      * otherwise acts as readline */
 #ifdef GAP_DEBUG
-    uint8_t *p = buf_flatten(gbf);
-    if (p) {
-        cstr_printf(&cstr,
-                "\x1b[2J\x1b[H" /* move to top the left and clear the entire screen */
-                "\x1b[7m"       /* reverse video */
-                "%s%s"          /* add prompt and flattened buffer */
-                "\x1b[m\n",     /* revert video back */
-                state.prompt, p);
-        free(p);
-    }
+    cstr_printf(&cstr,
+            "\x1b" "7\x1b[H" /* save the cursor, go to the top row */
+            "\x1b[7m%s",     /* reverse video, prompt */
+            state.prompt);
+    if (gbf->gap_start)
+        cstr_cat(&cstr, (const char *)gbf->data, gbf->gap_start);
+    for (col = gbf->gap_start; col < gbf->gap_end; ++col)
+        cstr_ccat(&cstr, '_');
+    if (gbf->capacity > gbf->gap_end)
+        cstr_cat(&cstr, (const char *)gbf->data + gbf->gap_end,
+                gbf->capacity - gbf->gap_end);
+    cstr_cat(&cstr, "\x1b[m\x1b[0K\x1b" "8", -1);
 #endif
 
-    /* add prompt */
-    cstr_printf(&cstr, "\r%s", state.prompt);
-
-    /* add buffer content */
-    buf_slice bs[2];
-    if (buf_view(gbf, 0, buf_len(gbf), bs)) {
-        if (bs[1].len)
-            cstr_printf(&cstr, SLICES_FMT, SLICES_ARG(bs));
-        else
-            cstr_printf(&cstr, SLICE_FMT, SLICE_ARG(bs[0]));
+#ifdef BUF_USE_DAMAGE
+    if (buf_damage_take(gbf, &d)) {
+        /* codepoints outside the damage did not change */
+        col = buf_offset_to_cp(gbf, d.start);
+        icols = buf_offset_to_cp(gbf, d.start + d.inserted) - col;
+        cols = buf_cp_count(gbf);
+        dcols = state.cols + icols - cols;
+        cstr_printf(&cstr, "\r\x1b[%zuC", strlen(state.prompt) + col);
+        if (dcols)
+            cstr_printf(&cstr, "\x1b[%zuP", dcols); /* delete characters */
+        if (icols)
+            cstr_printf(&cstr, "\x1b[%zu@", icols); /* insert blanks */
+        cstr_text(&cstr, gbf, d.start, d.inserted);
+        state.cols = cols;
     }
+#else
+    cstr_printf(&cstr, "\r%s", state.prompt);
+    cstr_text(&cstr, gbf, 0, buf_len(gbf));
+    cstr_cat(&cstr, "\x1b[0K", -1);
+    (void)col;
+#endif
 
-    cstr_printf(&cstr,
-            "\x1b[0K"      /* clear anythig after the cursor */
-            "\r\x1b[%zuC", /* move cursor to it's position */
-            strlen(state.prompt) + buf_cursor(gbf));
+    /* move cursor to it's position */
+    cstr_printf(&cstr, "\r\x1b[%zuC",
+            strlen(state.prompt) + buf_offset_to_cp(gbf, buf_cursor(gbf)));
 
     if (write(1, cstr.data, cstr.size) < 0)
         goto error;
@@ -238,6 +296,27 @@ error:
     return 0;
 }
 
+/* the whole line, after the screen was cleared */
+int repaint(void)
+{
+    CString cstr;
+    Buffer *gbf;
+    int r;
+
+    gbf = &state.gbf;
+#ifdef BUF_USE_DAMAGE
+    buf_damage_take(gbf, NULL);
+#endif
+    cstr_new(&cstr);
+    cstr_printf(&cstr, "\r%s", state.prompt);
+    cstr_text(&cstr, gbf, 0, buf_len(gbf));
+    cstr_cat(&cstr, "\x1b[0K", -1); /* clear anythig after the cursor */
+    state.cols = buf_cp_count(gbf);
+    r = write(1, cstr.data, cstr.size) >= 0;
+    cstr_free(&cstr);
+    return r && redraw();
+}
+
 int store(void)
 {
     int r;
@@ -257,14 +336,103 @@ int store(void)
     return r;
 }
 
+/* ------------------------------------------------------------------------- */
+/* input handling */
+/* keys, pastes and insert_run() take UTF-8 as it comes, split anywhere */
+#ifndef BUF_USE_UTF8
+#error "input handling needs BUF_USE_UTF8, see LIBFLAGS in the Makefile"
+#endif
+
+static int in_getc(unsigned char *c)
+{
+    ssize_t n;
+
+    if (state.in.pos == state.in.len) {
+        if ((n = read(0, state.in.buf, sizeof(state.in.buf))) <= 0)
+            return 0;
+        state.in.pos = 0;
+        state.in.len = n;
+    }
+    *c = state.in.buf[state.in.pos++];
+    return 1;
+}
+
+/* true while the codepoint before the cursor still misses bytes, the
+ * redraw waits for the rest */
+static int utf8_pending(Buffer *gbf)
+{
+    uint8_t lead;
+    size_t pos, need;
+
+    pos = buf_prev_cp(gbf, buf_cursor(gbf));
+    if (!buf_read(gbf, pos, &lead, 1))
+        return 0;
+    need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    return buf_cursor(gbf) - pos < need;
+}
+
+static int is_text(unsigned char c)
+{
+    /* UTF-8 arrives a byte at a time */
+    return isprint(c) || (c & 0x80);
+}
+
+/* the byte just taken and the text already read after it go in with one
+ * buf_cat, so a paste without bracketed paste is not a key at a time */
+static int insert_run(void)
+{
+    unsigned char *p;
+
+    p = state.in.buf + state.in.pos - 1;
+    while (state.in.pos < state.in.len && is_text(state.in.buf[state.in.pos]))
+        ++state.in.pos;
+    return buf_cat(&state.gbf, p, state.in.buf + state.in.pos - p);
+}
+
+/* everything up to ESC[201~ is text; line breaks and tabs turn into
+ * spaces, other control bytes are dropped. One buf_cat for all of it. */
+static int paste(void)
+{
+    static const char end[] = "\x1b[201~";
+    CString cstr;
+    unsigned char c;
+    size_t m;
+    int r;
+
+    r = 1;
+    cstr_new(&cstr);
+    for (m = 0; end[m];) {
+        if (!in_getc(&c)) {
+            r = 0;
+            break;
+        }
+        if (c == (unsigned char)end[m]) {
+            ++m;
+            continue;
+        }
+        if (m > 1) /* not the end after all */
+            cstr_cat(&cstr, end + 1, m - 1);
+        m = c == ESC;
+        if (c == '\n' || c == '\r' || c == '\t')
+            c = ' ';
+        if (is_text(c))
+            cstr_ccat(&cstr, c);
+    }
+    if (cstr.size && !buf_cat(&state.gbf, (const uint8_t *)cstr.data, cstr.size))
+        r = 0;
+    cstr_free(&cstr);
+    return r;
+}
+
 int edit(void)
 {
-    char c, seq[8];
+    unsigned char c, seq[8];
     Buffer *gbf;
+    size_t n;
 
     gbf = &state.gbf;
     while (1) {
-        if (read(0, &c, 1) < 0)
+        if (!in_getc(&c))
             return -1;
         switch(c) {
 #define CASE(x, fn) case x: fn; break;
@@ -275,18 +443,21 @@ int edit(void)
             CASE(CTRL_K, buf_kill_line(gbf));
             CASE(CTRL_U, buf_line_discard(gbf));
             CASE(CTRL_W, buf_word_rubout(gbf));
-            CASE(BACKSPACE, buf_delete(gbf, -1));
-            CASE(CTRL_L, clear_screen());
+            CASE(BACKSPACE, buf_delete_cp(gbf, -1));
+            case CTRL_L:
+            if (clear_screen() < 0 || !repaint())
+                return -1;
+            continue;
             case CTRL_D:
             if (buf_len(gbf)) {
-                buf_delete(gbf, 1);
+                buf_delete_cp(gbf, 1);
                 break;
             }
             return -1;
             case ENTER:
             goto end;
             case ESC:
-            if (read(0, seq, 1) < 0)
+            if (!in_getc(seq))
                 return -1;
             if (*seq >= 'a' && *seq <= 'z') {
                 switch (*seq) {
@@ -295,25 +466,33 @@ int edit(void)
                     CASE('d', buf_kill_word(gbf));     /* M-d */
                 }
             } else if (*seq == '[') {
-                if (read(0, seq+1, 1) <= 0)
+                if (!in_getc(seq+1))
                     return -1;
                 if (seq[1] >= '0' && seq[1] <= '9') {
-                    if (read(0, seq+2, 1) <= 0)
-                        return -1;
-                    if (seq[2] == ';') {
-                        if (read(0, seq+3, 2) <= 0)
+                    n = 0;
+                    do {
+                        n = n * 10 + seq[1] - '0';
+                        if (!in_getc(seq+1))
+                            return -1;
+                    } while (seq[1] >= '0' && seq[1] <= '9');
+                    if (seq[1] == ';') {
+                        if (!in_getc(seq+2) || !in_getc(seq+3))
                             return -1;
-                        if (seq[3] == '5') {
-                            switch (seq[4]) {
+                        if (seq[2] == '5') {
+                            switch (seq[3]) {
                                 CASE('C', buf_forward_word(gbf));  /* ctlr-right */
                                 CASE('D', buf_backward_word(gbf)); /* ctlr-left */
                             }
                         }
-                    } else if (seq[2] == '~') {
-                        switch (seq[1] ) {
-                            CASE('1', buf_home(gbf));
-                            CASE('3', buf_delete(gbf, 1));
-                            CASE('4', buf_end(gbf));
+                    } else if (seq[1] == '~') {
+                        switch (n) {
+                            CASE(1, buf_home(gbf));
+                            CASE(3, buf_delete_cp(gbf, 1));
+                            CASE(4, buf_end(gbf));
+                            case 200:
+                            if (!paste())
+                                return -1;
+                            break;
                         }
                     }
                 } else {
@@ -321,7 +500,7 @@ int edit(void)
                         CASE('C', buf_forward_char(gbf));
                         CASE('D', buf_backward_char(gbf));
 
-                        CASE('P', buf_delete(gbf, 1));
+                        CASE('P', buf_delete_cp(gbf, 1));
                         CASE('H', buf_home(gbf));
                         CASE('F', buf_end(gbf));
                     }
@@ -329,10 +508,16 @@ int edit(void)
             }
             break;
             default:
-            if (isprint(c))
-                buf_ccat(gbf, c);
+            if (is_text(c)) {
+                insert_run();
+                if (utf8_pending(gbf))
+                    continue;
+            }
             break;
         }
+        /* at most one redraw per batch of input */
+        if (state.in.pos < state.in.len)
+            continue;
         if (!redraw())
             return -1;
     }
@@ -342,19 +527,25 @@ end:
 
 int repl_read(const char *prompt, char *dst, const size_t dst_sz)
 {
+    uint8_t line[LINE_INLINE]; /* short lines never touch the heap */
     int r;
     if (!prompt || !dst || !dst_sz)
         return -1;
 
     if (rawmode_start() < 0)
         return -1;
+#ifdef GAP_DEBUG
+    if (clear_screen() < 0)
+        return -1;
+#endif
     if (write(1, prompt, strlen(prompt)) < 0)
         return -1;
 
     state.prompt = prompt;
     state.dst = dst;
     state.dst_sz = dst_sz;
-    buf_new(&state.gbf);
+    state.cols = 0;
+    buf_new_inline(&state.gbf, line, sizeof(line));
 
     r = edit();
 
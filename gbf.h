@@ -23,6 +23,18 @@ SOFTWARE.*/
 #ifndef GBF_H_
 #define GBF_H_
 
+/* The implementation uses POSIX.1-2008 and a few BSD extras (MAP_ANONYMOUS,
+ * madvise()) that -std=c99 hides. These only take effect if no system
+ * header was included before this one. */
+#if defined(GBF_IMPLEMENTATION) && defined(__linux__) && !defined(_GNU_SOURCE)
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,19 +44,212 @@ extern "C" {
 #include <string.h>
 #include <assert.h>
 
-#ifdef USE_EXTENTION
-#include <ctype.h>
-#endif
-
 #ifndef BUF_INIT_SIZE
 #define BUF_INIT_SIZE 1024
 #endif
 
+/* With BUF_USE_CHUNKS, the most text one chunk holds: about what an edit
+ * moves, however long the text. */
+#ifndef BUF_CHUNK_SIZE
+#define BUF_CHUNK_SIZE ((size_t)16 << 10)
+#endif
+
+/* chunks leave no single block to share or compress */
+#if defined(BUF_USE_CHUNKS) && (defined(BUF_USE_SNAPSHOT) || defined(BUF_USE_FREEZE))
+#error "BUF_USE_CHUNKS does not go with BUF_USE_SNAPSHOT or BUF_USE_FREEZE"
+#endif
+
+/* With BUF_USE_POSIX, buffers on the default allocator that grow to this
+ * size move to anonymous mmap()ed storage. On Linux with _GNU_SOURCE they
+ * then grow with mremap(), and the text after the gap is moved by
+ * remapping its pages instead of copying it. Define BUF_MMAP_HUGEPAGE to
+ * also ask for transparent huge pages. */
+#ifndef BUF_MMAP_THRESHOLD
+#define BUF_MMAP_THRESHOLD ((size_t)64 << 20)
+#endif
+
+/* With BUF_USE_UTF8, bytes between codepoint checkpoints: conversions
+ * scan at most about twice this far. */
+#ifndef BUF_UTF8_STEP
+#define BUF_UTF8_STEP 256
+#endif
+
+/* With BUF_USE_THREADS, the most a scan kernel is fed at once (sized to
+ * stay in L2) and the largest pool. */
+#ifndef BUF_PAR_CHUNK
+#define BUF_PAR_CHUNK ((size_t)256 << 10)
+#endif
+#ifndef BUF_PAR_MAX_THREADS
+#define BUF_PAR_MAX_THREADS 64
+#endif
+
+/* With BUF_USE_JOURNAL, the default group commit window, and how many
+ * bytes of records may wait in memory before they are written out (not
+ * synced) anyway; logs smaller than that are never compacted. */
+#ifndef BUF_JOURNAL_SYNC_MS
+#define BUF_JOURNAL_SYNC_MS 100
+#endif
+#ifndef BUF_JOURNAL_BUF
+#define BUF_JOURNAL_BUF ((size_t)64 << 10)
+#endif
+
+/* With BUF_USE_SLAB, the size classes of buf_slab: powers of two from
+ * 2^BUF_SLAB_MIN_SHIFT to 2^BUF_SLAB_MAX_SHIFT bytes. */
+#ifndef BUF_SLAB_MIN_SHIFT
+#define BUF_SLAB_MIN_SHIFT 6
+#endif
+#ifndef BUF_SLAB_MAX_SHIFT
+#define BUF_SLAB_MAX_SHIFT 20
+#endif
+#define BUF_SLAB_CLASSES (BUF_SLAB_MAX_SHIFT - BUF_SLAB_MIN_SHIFT + 1)
+
+/* the journal lives in files */
+#if defined(BUF_USE_JOURNAL) && !defined(BUF_USE_POSIX)
+#define BUF_USE_POSIX
+#endif
+
+/* Sorted offsets kept in a gap array of their own: entries before the gap
+ * are absolute, entries after it are stored as distance from the end of the
+ * text, so an edit at the gap never has to touch the ones that follow it. */
+typedef struct {
+    size_t *v;
+    size_t lo;
+    size_t hi;
+    size_t cap;
+} buf_offv;
+
+/* Memory hooks. Sizes are passed back so arena and slab allocators need
+ * no headers; realloc is called with p == NULL only through alloc. */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t n);
+    void *(*realloc)(void *ctx, void *p, size_t old, size_t n);
+    void (*free)(void *ctx, void *p, size_t n);
+    void *ctx;
+} buf_allocator;
+
+/* How capacity changes. If grow is set it picks the new capacity (at
+ * least need) on its own, otherwise capacity starts at init and is
+ * multiplied by factor/100, adding at most max_step bytes per step
+ * (0: no cap). buf_reset() and buf_delete() give memory back once the
+ * text fills less than shrink percent of it (0: never). An init of 0 or
+ * a factor of 100 or less gets the built-in value instead, so a zeroed
+ * policy with just shrink set still grows geometrically. A grow hook
+ * that returns less than need fails the allocation. */
+typedef struct {
+    size_t init;
+    unsigned factor;
+    size_t max_step;
+    unsigned shrink;
+    size_t (*grow)(void *ctx, size_t cap, size_t need);
+    void *ctx;
+} buf_growth;
+
+/* A change to the text as one replacement: the old bytes
+ * [start, start+removed) became the new bytes [start, start+inserted),
+ * everything before and after stayed as it was. */
 typedef struct {
+    size_t start;
+    size_t removed;
+    size_t inserted;
+} buf_change;
+
+/* Buffer.flags: where data came from */
+enum {
+    BUF_F_MAPPED = 1 << 0,   /* mmap()ed, see BUF_MMAP_THRESHOLD */
+    BUF_F_FILE = 1 << 1,     /* ...over a file, see buf_open_mmap() */
+    BUF_F_BORROWED = 1 << 2, /* the caller's, see buf_new_inline() */
+    BUF_F_NOSHRINK = 1 << 3  /* inside buf_apply_edits(), hold on to memory */
+};
+
+typedef struct Buffer {
     size_t gap_start;
     size_t gap_end;
     size_t capacity;
+    size_t cursor; /* the gap only follows it on the next edit */
     uint8_t *data;
+    unsigned flags;
+    const buf_allocator *alloc; /* NULL: the global default */
+    const buf_growth *growth;   /* NULL: the global default */
+#ifdef BUF_USE_CHUNKS
+    struct {
+        buf_offv off;     /* where each chunk starts, see "Chunked storage" */
+        uint8_t **ptr;    /* its bytes, beside each entry of off */
+        uint8_t *spare;   /* free chunks, chained through their first bytes */
+        size_t nspare;
+        uint8_t *scratch; /* see buf_chunk_gather() */
+        size_t nscratch;
+    } chunks;
+#endif
+#ifdef BUF_USE_SNAPSHOT
+    struct {
+        struct buf_share *share; /* data is shared with snapshots */
+        size_t lo;               /* [lo, hi) of data is in every */
+        size_t hi;               /* snapshot's gap, free to write */
+    } snap;
+#endif
+#ifdef BUF_USE_LINES
+    buf_offv lines; /* offset of every '\n' */
+#endif
+#ifdef BUF_USE_UTF8
+    struct {
+        buf_offv off; /* checkpoints, see BUF_UTF8_STEP */
+        buf_offv cnt; /* codepoints before each checkpoint */
+        size_t total;
+    } utf8;
+#endif
+#ifdef BUF_USE_MARKS
+    struct {
+        buf_offv off; /* see buf_marks_split() */
+        size_t *tag; /* id << 1 | right-sticky, beside each entry of off */
+        size_t *slot; /* entry of each id; free ids chain through it */
+        size_t nslot;
+        size_t free; /* first free id + 1, 0 if none */
+    } marks;
+#endif
+#ifdef BUF_USE_JOURNAL
+    struct buf_journal *journal; /* see buf_journal_replay() */
+#endif
+#ifdef BUF_USE_SLAB
+    int touched; /* edited since the last buf_compact_idle() */
+#endif
+#ifdef BUF_USE_FREEZE
+    struct {
+        uint8_t *z; /* compressed text, see buf_freeze() */
+        size_t zlen;
+        size_t len;
+        struct buf_lru *lru;
+        struct Buffer *prev; /* toward lru->head */
+        struct Buffer *next;
+    } frz;
+#endif
+#ifdef BUF_USE_DAMAGE
+    struct {
+        buf_change range;
+        size_t base; /* length at the last buf_damage_take() */
+        int dirty;
+    } damage;
+#endif
+#ifdef BUF_USE_OBSERVE
+    struct {
+        struct buf_observer *v;
+        size_t n;
+        size_t cap;
+        buf_change pending; /* since the last notification */
+        int dirty;
+        int batch; /* buf_batch_begin() depth */
+    } obs;
+#endif
+#ifdef BUF_USE_UNDO
+    struct {
+        uint8_t *data; /* records, see buf_undo_push() */
+        size_t len;
+        size_t top;
+        size_t cap;
+        size_t limit;
+        int seal;
+        int busy;
+    } undo;
+#endif
 } Buffer;
 
 typedef struct {
@@ -61,6 +266,86 @@ void buf_new(Buffer *b);
 void buf_reset(Buffer *b);
 void buf_free(Buffer *b);
 
+/* buf_new() over n bytes of the caller's memory, e.g. a stack array:
+ * text that fits allocates nothing, and moves to the allocator's memory
+ * the first time it outgrows mem. mem must outlive that or buf_free(),
+ * which forgets it; buf_reset() keeps using it. With BUF_USE_CHUNKS mem
+ * goes unused, chunks always come from the allocator. */
+void buf_new_inline(Buffer *b, void *mem, size_t n);
+
+/* Defaults for buffers whose alloc/growth is NULL; NULL restores the
+ * built-in ones (stdlib, doubling from BUF_INIT_SIZE, never shrink).
+ * The allocator of a buffer can only change while it owns no memory,
+ * i.e. right after buf_new() or buf_free(). */
+void buf_set_default_allocator(const buf_allocator *a);
+void buf_set_default_growth(const buf_growth *g);
+int buf_set_allocator(Buffer *b, const buf_allocator *a);
+void buf_set_growth(Buffer *b, const buf_growth *g);
+
+/* Drop the gap and give the spare capacity back to the allocator
+ * (inline storage is kept as it is). */
+int buf_shrink_to_fit(Buffer *b);
+
+#ifdef BUF_USE_FREEZE
+/* Compress b's text with a small built-in LZ codec and free its
+ * storage. Lengths, the cursor and the line/codepoint indexes stay
+ * available; any call that needs the bytes thaws b first, const readers
+ * included, so a frozen buffer must not be read from several threads at
+ * once. Returns 1 if b is frozen, 0 if it is empty, the text did not
+ * shrink by at least an eighth, lives in inline storage, or memory ran
+ * out.
+ * buf_thaw() fails only if memory runs out. */
+int buf_freeze(Buffer *b);
+int buf_thaw(Buffer *b);
+int buf_frozen(const Buffer *b);
+
+/* Recency list to pick what to freeze. Edits and thawing move a buffer
+ * to the head; call buf_lru_touch() for reads worth counting as use.
+ * buf_lru_freeze() freezes from the tail until the thawed buffers of l
+ * hold at most keep bytes of storage, and returns the bytes saved.
+ * buf_free() takes a buffer off its list. Zero-initialize l. */
+typedef struct buf_lru {
+    Buffer *head;
+    Buffer *tail;
+} buf_lru;
+
+void buf_lru_add(buf_lru *l, Buffer *b);
+void buf_lru_remove(Buffer *b);
+void buf_lru_touch(Buffer *b);
+size_t buf_lru_freeze(buf_lru *l, size_t keep);
+#endif /* BUF_USE_FREEZE */
+
+#ifdef BUF_USE_SLAB
+/* Allocator for processes holding many buffers: blocks are rounded up
+ * to a power-of-two size class and freed blocks are kept on a list per
+ * class for the next buffer, so churn does not reach malloc and a
+ * buffer growing within its class is not copied. Blocks over the largest
+ * class go to malloc directly. Free blocks beyond max_cached bytes (0:
+ * no limit) are not kept. Not thread-safe: one per thread, or lock.
+ *   buf_slab_init(&slab, 0);
+ *   buf_set_allocator(&b, &slab.alloc);
+ * buf_slab_trim() hands cached blocks back to malloc, largest first,
+ * until at most keep bytes are left, and has glibc return the pages;
+ * buf_slab_destroy() all of them, once its buffers are freed. */
+typedef struct {
+    buf_allocator alloc;
+    void *free[BUF_SLAB_CLASSES];
+    size_t cached;
+    size_t max_cached;
+} buf_slab;
+
+void buf_slab_init(buf_slab *s, size_t max_cached);
+size_t buf_slab_trim(buf_slab *s, size_t keep);
+void buf_slab_destroy(buf_slab *s);
+
+/* Compaction pass, one buffer at a time: run it over every buffer now
+ * and then. A buffer not edited since the previous pass has its gap
+ * shrunk to reserve bytes, its storage moving to a smaller block; returns
+ * the bytes of capacity given up. Follow with buf_slab_trim() to hand
+ * the pages back. */
+size_t buf_compact_idle(Buffer *b, size_t reserve);
+#endif /* BUF_USE_SLAB */
+
 size_t buf_len(const Buffer *b);
 size_t buf_cursor(const Buffer *b);
 
@@ -71,424 +356,4708 @@ int buf_cat(Buffer *b, const uint8_t *s, size_t n);
 int buf_insert(Buffer *b, size_t pos, const uint8_t *s, size_t n);
 int buf_delete(Buffer *b, ptrdiff_t delta);
 
+/* One replacement for buf_apply_edits(): del bytes at pos are replaced by
+ * s[0, len). Positions refer to the text before any edit is applied. */
+typedef struct {
+    size_t pos;
+    size_t del;
+    const uint8_t *s;
+    size_t len;
+} buf_edit;
+
+/* Apply n non-overlapping edits in one left-to-right sweep: the final size
+ * is reserved once and every byte between edits moves at most once.
+ * Edits need not be sorted; ones at the same position keep their order.
+ * Fails without changing anything if edits overlap or fall outside the
+ * text. Leaves the cursor after the last replacement. */
+int buf_apply_edits(Buffer *b, const buf_edit *edits, size_t n);
+
 size_t buf_read(const Buffer *b, size_t pos, uint8_t *dst, size_t n);
 
 /* The buffer uses a gap, so [pos, pos+n) may be split:
  *   out[0]  bytes before the gap
  *   out[1]  bytes after the gap.
  * If contiguous, out[1] is zeroed.
- * Slices remain valid until the buffer is modified or freed. */
+ * Slices remain valid until the buffer is modified or freed.
+ * With BUF_USE_CHUNKS the two halves are two chunks; a range over more
+ * than two is copied into one scratch block, which the next such view
+ * overwrites. Prefer buf_iter for long ranges. */
 size_t buf_view(const Buffer *b, size_t pos, size_t n, buf_slice out[2]);
 
-/* Materialize the entire buffer into a NULL-terminated string.
- * Allocates; caller owns result.
- * O(n). Intended for debugging, I/O, and interp only. */
-uint8_t *buf_flatten(const Buffer *b);
+/* Storage-neutral walk over [pos, pos+n) (n == 0 means to the end) as
+ * contiguous runs, in order. Loops written against it do not depend on
+ * how many pieces the text is split into.
+ *   buf_iter it;
+ *   buf_slice s;
+ *   for (buf_iter_init(&it, b, 0, 0); buf_iter_next(&it, &s);)
+ *       fwrite(s.ptr, 1, s.len, stdout);
+ * Same lifetime rules as buf_view(). */
+typedef struct {
+    const Buffer *b;
+    size_t pos;
+    size_t end;
+} buf_iter;
+
+void buf_iter_init(buf_iter *it, const Buffer *b, size_t pos, size_t n);
+int buf_iter_next(buf_iter *it, buf_slice *out);
+
+/* Materialize the entire buffer into a NULL-terminated string.
+ * Allocates; caller owns result.
+ * O(n). Intended for debugging, I/O, and interp only. */
+uint8_t *buf_flatten(const Buffer *b);
+
+#ifdef BUF_USE_SNAPSHOT
+/* Immutable copy of b's text for other threads, in O(1): it shares b's
+ * storage until b writes to bytes the snapshot can see, at which point b
+ * copies its text to a new block and leaves the old one to the snapshots.
+ * The writer never waits for readers and readers take no locks; the last
+ * of them to let go frees the storage.
+ * Use the result with the read-only calls (buf_len, buf_view, buf_read,
+ * buf_iter_*, buf_find, buf_write_fd, ...). It carries the text only, not
+ * the line, codepoint or undo indexes. Release it from any thread. */
+const Buffer *buf_snapshot(Buffer *b);
+void buf_snapshot_release(const Buffer *snap);
+#endif /* BUF_USE_SNAPSHOT */
+
+/* Compiled search pattern, reusable across calls and buffers. Keeps a
+ * pointer to s, which must outlive it. */
+typedef struct {
+    const uint8_t *s;
+    size_t n;
+    size_t skip[256];  /* Horspool shifts, forward */
+    size_t rskip[256]; /* ...and reverse */
+} buf_pattern;
+
+#define BUF_NPOS ((size_t)-1)
+
+void buf_pattern_init(buf_pattern *p, const uint8_t *s, size_t n);
+
+/* Offset of the first match starting at or after from, or of the last
+ * one ending at or before end; BUF_NPOS if there is none. Runs over both
+ * sides of the gap in place (matches may straddle it), allocates nothing. */
+size_t buf_find(const Buffer *b, const buf_pattern *p, size_t from);
+size_t buf_rfind(const Buffer *b, const buf_pattern *p, size_t end);
+
+/* Line by line walk with no copies: each line, without its '\n', comes
+ * back in out[0] and, when it straddles the gap, out[1] (zeroed if not),
+ * like buf_view(). Lines are those of buf_line_count(): text ending in
+ * '\n' has an empty last line. Init starts at the line holding pos;
+ * buf_line_next() goes on toward the end, buf_line_prev() toward the
+ * start, each on its own. They return the offset of the line, BUF_NPOS
+ * once there is none left. Same lifetime rules as buf_view().
+ *   buf_line_iter it;
+ *   buf_slice s[2];
+ *   for (buf_line_iter_init(&it, b, 0); buf_line_next(&it, s) != BUF_NPOS;)
+ *       printf(SLICES_FMT "\n", SLICES_ARG(s));
+ */
+typedef struct {
+    const Buffer *b;
+    size_t next; /* start of the line buf_line_next() returns */
+    size_t prev; /* end of the line buf_line_prev() returns */
+} buf_line_iter;
+
+void buf_line_iter_init(buf_line_iter *it, const Buffer *b, size_t pos);
+size_t buf_line_next(buf_line_iter *it, buf_slice out[2]);
+size_t buf_line_prev(buf_line_iter *it, buf_slice out[2]);
+
+#ifdef BUF_USE_THREADS
+/* Parallel scans (link with -pthread). [pos, pos+n) (n == 0 means to the
+ * end) is cut into one stripe per worker and a few more for balance;
+ * each stripe gets a state of its own, set up by init and fed its text
+ * in order, in contiguous runs of at most BUF_PAR_CHUNK bytes, by chunk.
+ * The states are then merged left to right into result, which also goes
+ * through init. A kernel must not change the buffer, nor may anyone else
+ * while the scan runs (scanning a buf_snapshot() is fine). */
+typedef struct {
+    size_t state_size;
+    void (*init)(void *ctx, void *state);
+    void (*chunk)(void *ctx, void *state, size_t pos, const uint8_t *p, size_t n);
+    void (*merge)(void *ctx, void *into, const void *next);
+    void *ctx;
+} buf_kernel;
+
+int buf_par_scan(const Buffer *b, size_t pos, size_t n, const buf_kernel *k, void *result);
+
+/* Worker threads, counting the caller: 0 picks one per online CPU, 1
+ * stops the pool. Started on first use. */
+int buf_par_threads(unsigned n);
+
+/* Built-in kernels over the whole text. buf_par_count() counts every
+ * position a match starts at, overlapping ones included. */
+size_t buf_par_count_byte(const Buffer *b, uint8_t c);
+size_t buf_par_count_lines(const Buffer *b);
+size_t buf_par_count(const Buffer *b, const buf_pattern *p);
+int buf_par_histogram(const Buffer *b, uint64_t hist[256]);
+#endif /* BUF_USE_THREADS */
+
+#ifdef BUF_USE_POSIX
+/* Load the whole of fd without reading it: the file is mapped private and
+ * copy-on-write, so buf_view()/buf_read() point into the page cache and
+ * only the pages an edit writes to get copied. Cursor and gap, sized by
+ * the growth policy, start at the end of the file; the first edit at pos
+ * moves the gap there, which touches the pages from pos to the end.
+ * Replaces b's contents. fd may be closed afterwards. With BUF_USE_CHUNKS
+ * the file is read into chunks instead. */
+int buf_open_mmap(Buffer *b, int fd);
+
+/* Write [pos, pos+n) (n == 0 means to the end) to fd with writev(), straight
+ * from both sides of the gap (or from the chunks); retries short writes and
+ * EINTR. */
+int buf_write_fd(const Buffer *b, int fd, size_t pos, size_t n);
+
+/* Replace path atomically: write a temporary file next to it, fsync,
+ * then rename over path. An existing file keeps its permissions. */
+int buf_save(const Buffer *b, const char *path);
+#endif /* BUF_USE_POSIX */
+
+#ifdef BUF_USE_JOURNAL
+/* Crash journal: every edit appends a record (kind, position, length,
+ * inserted bytes, CRC-32) to a log file, so durability costs O(edit)
+ * instead of rewriting the file. Records are group-committed: written
+ * and fdatasync()ed by the first edit once sync_ms have passed since the
+ * last commit (0: by every edit), or by buf_journal_sync(); call that
+ * when idle, the edits since the last commit are what a crash loses.
+ * A checkpoint saves the text over the base file and restarts the log;
+ * it happens on its own once the log outgrows compact percent of the
+ * text (0: only through buf_journal_checkpoint()).
+ * I/O errors do not fail edits. They stick until the next successful
+ * checkpoint and make buf_journal_sync() return 0, as does replacing the
+ * text with buf_open_mmap(), which the log cannot express. */
+typedef struct {
+    unsigned sync_ms;
+    unsigned compact;
+} buf_journal_conf;
+
+/* Rebuild b from the file at path (which need not exist yet) plus the
+ * records in log_fd made on top of it, then keep logging to log_fd.
+ * A torn record at the end, left by a crash, is cut off; a log written
+ * for another version of the file (a checkpoint that crashed after the
+ * save) is started over. Checksums the whole file.
+ * conf NULL: commit every BUF_JOURNAL_SYNC_MS, compact at 100%. */
+int buf_journal_replay(Buffer *b, const char *path, int log_fd, const buf_journal_conf *conf);
+int buf_journal_sync(Buffer *b);
+int buf_journal_checkpoint(Buffer *b);
+int buf_journal_close(Buffer *b); /* commit and stop logging; log_fd stays open */
+#endif /* BUF_USE_JOURNAL */
+
+#ifdef BUF_USE_LINES
+/* Line index, updated by every edit. Lines are 0-based and separated
+ * by '\n'; lookups are O(log n).
+ * buf_line_to_offset() clamps lines past the end to buf_len(). */
+size_t buf_line_count(const Buffer *b);
+size_t buf_line_to_offset(const Buffer *b, size_t line);
+size_t buf_offset_to_line(const Buffer *b, size_t pos);
+#endif /* BUF_USE_LINES */
+
+#ifdef BUF_USE_MARKS
+/* Positions that follow the edits: text inserted or deleted before a
+ * marker moves it, a deletion around it leaves it at the start of the
+ * deleted span. Text inserted right at a marker goes after a
+ * BUF_MARK_LEFT one and before a BUF_MARK_RIGHT one.
+ * Edits cost O(markers between them and the previous edit), lookups by
+ * id O(1). buf_reset() and buf_open_mmap() move every marker to 0. */
+#define BUF_MARK_LEFT 0
+#define BUF_MARK_RIGHT 1
+
+size_t buf_mark_new(Buffer *b, size_t pos, int sticky); /* an id, BUF_NPOS on failure */
+size_t buf_mark_get(const Buffer *b, size_t id); /* BUF_NPOS if id is not live */
+int buf_mark_set(Buffer *b, size_t id, size_t pos);
+void buf_mark_free(Buffer *b, size_t id);
+/* Ids of the markers in [from, to), in offset order: stores up to max
+ * of them and returns how many there are, in O(log n + max). */
+size_t buf_mark_range(const Buffer *b, size_t from, size_t to, size_t *out, size_t max);
+#endif /* BUF_USE_MARKS */
+
+#ifdef BUF_USE_UTF8
+/* UTF-8 awareness. Positions stay byte offsets. Every byte that is not a
+ * continuation byte (10xxxxxx) starts a codepoint, so malformed text is
+ * still walked and counted consistently, one byte at a time.
+ * Motions and deletions step over whole codepoints and fail, like
+ * buf_cursor_move(), when fewer than n are left. Codepoint indexes and
+ * byte offsets convert in O(log n) through checkpoints kept up to date by
+ * every edit; indexes past the end clamp to it. */
+int buf_utf8_valid(const uint8_t *s, size_t n);
+int buf_cat_utf8(Buffer *b, const uint8_t *s, size_t n); /* 0 if s is not valid UTF-8 */
+size_t buf_next_cp(const Buffer *b, size_t pos);
+size_t buf_prev_cp(const Buffer *b, size_t pos);
+int buf_cursor_move_cp(Buffer *b, ptrdiff_t n);
+int buf_delete_cp(Buffer *b, ptrdiff_t n);
+size_t buf_cp_count(const Buffer *b);
+size_t buf_cp_to_offset(const Buffer *b, size_t cp);
+size_t buf_offset_to_cp(const Buffer *b, size_t pos);
+#endif /* BUF_USE_UTF8 */
+
+#ifdef BUF_USE_UNDO
+/* Undo history fed by every edit. Consecutive typing, backspacing or
+ * forward deletion at the same spot is merged into one step; call
+ * buf_undo_seal() to end a step early. buf_undo_limit() caps the memory
+ * the history may use (0, the default, means no cap); the oldest steps
+ * are dropped first, and an edit too big to fit at all clears it.
+ * Undo/redo return 0 when there is nothing to do. */
+int buf_undo(Buffer *b);
+int buf_redo(Buffer *b);
+void buf_undo_seal(Buffer *b);
+void buf_undo_limit(Buffer *b, size_t bytes);
+void buf_undo_clear(Buffer *b);
+#endif /* BUF_USE_UNDO */
+
+#ifdef BUF_USE_DAMAGE
+/* Damage tracking for incremental redraws: every edit since the last
+ * take is folded into one buf_change covering all of them, relative to
+ * the text as it was then; inserted - removed is the length delta.
+ * Returns 0, leaving out alone, when nothing changed. */
+int buf_damage_take(Buffer *b, buf_change *out);
+#endif /* BUF_USE_DAMAGE */
+
+#ifdef BUF_USE_OBSERVE
+/* Change notifications. Once an edit is done every observer gets it as
+ * one buf_change relative to the text before it, in the order they were
+ * added; they may read b but not edit it. Between buf_batch_begin() and
+ * buf_batch_end(), which nest, edits are folded into the single change
+ * the outermost end delivers; buf_apply_edits() is one batch by itself.
+ * buf_reset() and buf_open_mmap() report the whole text as replaced. */
+typedef void (*buf_observer_fn)(void *ctx, const Buffer *b, const buf_change *c);
+
+int buf_observe(Buffer *b, buf_observer_fn fn, void *ctx);
+int buf_unobserve(Buffer *b, buf_observer_fn fn, void *ctx); /* 0 if not observing */
+void buf_batch_begin(Buffer *b);
+void buf_batch_end(Buffer *b);
+#endif /* BUF_USE_OBSERVE */
+
+#ifdef BUF_USE_STATS
+/* Counters of the work done by the calling thread, across all of its
+ * buffers. memmove_bytes covers every byte of text moved or copied:
+ * gap moves, tails shifted on regrow and compaction, copies into fresh
+ * storage. realloc_bytes is the old capacity handed to realloc(), an
+ * upper bound on what it copied.
+ * With BUF_STATS_TIMING the cycles (see BUF_CYCLES) spent in each gap
+ * move and regrow are also counted into power-of-two histograms: bucket
+ * i counts calls that took [2^i, 2^(i+1)) cycles. */
+#define BUF_STATS_BUCKETS 32
+
+typedef struct {
+    uint64_t gap_moves;
+    uint64_t gap_move_bytes;
+    uint64_t memmove_bytes;
+    uint64_t reallocs;
+    uint64_t realloc_bytes;
+    size_t peak_capacity;
+#ifdef BUF_STATS_TIMING
+    uint64_t move_cycles[BUF_STATS_BUCKETS];
+    uint64_t reserve_cycles[BUF_STATS_BUCKETS];
+#endif
+} buf_stats;
+
+void buf_stats_get(buf_stats *out);
+void buf_stats_reset(void);
+#endif /* BUF_USE_STATS */
+
+#ifdef USE_EXTENTION
+int buf_forward_char(Buffer *b);
+int buf_backward_char(Buffer *b);
+int buf_forward_word(Buffer *b);
+int buf_backward_word(Buffer *b);
+int buf_home(Buffer *b);
+int buf_end(Buffer *b);
+int buf_kill_word(Buffer *b);
+int buf_kill_line(Buffer *b);
+int buf_line_discard(Buffer *b);
+int buf_word_rubout(Buffer *b);
+#endif /* USE_EXTENTION */
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef GBF_IMPLEMENTATION
+
+/* Vector width used by the byte scanners, picked at compile time.
+ * Define BUF_NO_SIMD to force the scalar loops. */
+#if defined(BUF_NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define BUF_SIMD_AVX2
+#define BUF_SIMD_W 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BUF_SIMD_SSE2
+#define BUF_SIMD_W 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BUF_SIMD_NEON
+#define BUF_SIMD_W 16
+#endif
+
+#ifdef BUF_USE_CHUNKS
+static int buf_chunk_reserve(Buffer *b, size_t n);
+static void buf_chunk_insert(Buffer *b, size_t pos, const uint8_t *s, size_t n);
+static void buf_chunk_erase(Buffer *b, size_t pos, size_t n);
+static void buf_chunk_clear(Buffer *b);
+static int buf_chunk_trim(Buffer *b);
+static void buf_chunk_drop(Buffer *b);
+#endif
+
+#if defined(BUF_STATS_TIMING) && !defined(BUF_CYCLES)
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BUF_CYCLES() __rdtsc()
+#elif defined(__aarch64__) && defined(__GNUC__)
+static inline uint64_t buf_cntvct(void)
+{
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+}
+#define BUF_CYCLES() buf_cntvct()
+#else
+#include <time.h>
+#define BUF_CYCLES() ((uint64_t)clock())
+#endif
+#endif
+
+/* Bring a frozen buffer's bytes back before touching them; 0 if that
+ * failed. Const readers do it too, see buf_freeze(). */
+#ifdef BUF_USE_FREEZE
+#define BUF_THAW(b) (!(b)->frz.z || buf_thaw((Buffer *)(b)))
+#else
+#define BUF_THAW(b) 1
+#endif
+
+/* set when something replaces the text wholesale, see buf_reindex() */
+#if defined(BUF_USE_POSIX)
+#define BUF_REINDEX
+#endif
+
+#ifdef BUF_USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef BUF_USE_POSIX
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef BUF_USE_JOURNAL
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+#if defined(BUF_USE_SLAB) && defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#ifdef BUF_USE_OBSERVE
+struct buf_observer {
+    buf_observer_fn fn;
+    void *ctx;
+};
+#endif
+
+void buf_new(Buffer *b)
+{
+    if (!b)
+        return;
+    memset(b, 0, sizeof(*b));
+}
+
+void buf_new_inline(Buffer *b, void *mem, size_t n)
+{
+    buf_new(b);
+#ifdef BUF_USE_CHUNKS
+    (void)mem; (void)n;
+#else
+    if (!b || !mem || !n)
+        return;
+    b->data = (uint8_t *)mem;
+    b->capacity = b->gap_end = n;
+    b->flags = BUF_F_BORROWED;
+#endif
+}
+
+static void buf_mem_free(const Buffer *b, void *p, size_t n);
+static int buf_compact(Buffer *b, size_t reserve);
+static void buf_did_edit(Buffer *b);
+#ifdef BUF_USE_JOURNAL
+static void buf_journal_reset(Buffer *b);
+#endif
+#ifdef BUF_USE_FREEZE
+static void buf_frz_drop(Buffer *b);
+#endif
+#ifdef BUF_USE_MARKS
+static void buf_marks_clear(Buffer *b);
+#endif
+#ifdef BUF_USE_OBSERVE
+static void buf_obs_add(Buffer *b, size_t pos, size_t del, size_t ins);
+static void buf_obs_flush(Buffer *b);
+#endif
+static const buf_growth *buf_growth_of(const Buffer *b);
+static size_t buf_growth_init(const buf_growth *g);
+
+void buf_reset(Buffer *b)
+{
+    const buf_growth *g;
+
+    if (!b)
+        return;
+#ifdef BUF_USE_JOURNAL
+    if (b->journal && buf_len(b))
+        buf_journal_reset(b);
+#endif
+#ifdef BUF_USE_OBSERVE
+    if (buf_len(b))
+        buf_obs_add(b, 0, buf_len(b), 0);
+#endif
+#ifdef BUF_USE_FREEZE
+    buf_frz_drop(b);
+#endif
+#ifdef BUF_USE_CHUNKS
+    buf_chunk_clear(b);
+    b->capacity = 0;
+#endif
+    b->gap_start = b->cursor = 0;
+    b->gap_end = b->capacity;
+    g = buf_growth_of(b);
+    if (g->shrink && b->capacity > buf_growth_init(g))
+        buf_compact(b, buf_growth_init(g));
+#ifdef BUF_USE_LINES
+    b->lines.lo = 0;
+    b->lines.hi = b->lines.cap;
+#endif
+#ifdef BUF_USE_UTF8
+    b->utf8.off.lo = b->utf8.cnt.lo = 0;
+    b->utf8.off.hi = b->utf8.off.cap;
+    b->utf8.cnt.hi = b->utf8.cnt.cap;
+    b->utf8.total = 0;
+#endif
+#ifdef BUF_USE_MARKS
+    buf_marks_clear(b);
+#endif
+#ifdef BUF_USE_UNDO
+    b->undo.len = b->undo.top = 0;
+#endif
+#ifdef BUF_USE_DAMAGE
+    if (b->damage.base || b->damage.dirty) {
+        b->damage.range.start = b->damage.range.inserted = 0;
+        b->damage.range.removed = b->damage.base;
+        b->damage.dirty = 1;
+    }
+#endif
+    buf_did_edit(b);
+}
+
+static void buf_release(Buffer *b);
+
+void buf_free(Buffer *b)
+{
+    if (!b)
+        return;
+#ifdef BUF_USE_JOURNAL
+    buf_journal_close(b);
+#endif
+#ifdef BUF_USE_FREEZE
+    buf_lru_remove(b);
+    buf_frz_drop(b);
+#endif
+    buf_release(b);
+#ifdef BUF_USE_CHUNKS
+    buf_chunk_drop(b);
+#endif
+    b->data = NULL;
+    b->flags &= ~BUF_F_BORROWED;
+    b->capacity = b->gap_start = b->gap_end = b->cursor = 0;
+#ifdef BUF_USE_LINES
+    buf_mem_free(b, b->lines.v, b->lines.cap * sizeof(*b->lines.v));
+    memset(&b->lines, 0, sizeof(b->lines));
+#endif
+#ifdef BUF_USE_UTF8
+    buf_mem_free(b, b->utf8.off.v, b->utf8.off.cap * sizeof(*b->utf8.off.v));
+    buf_mem_free(b, b->utf8.cnt.v, b->utf8.cnt.cap * sizeof(*b->utf8.cnt.v));
+    memset(&b->utf8, 0, sizeof(b->utf8));
+#endif
+#ifdef BUF_USE_MARKS
+    buf_mem_free(b, b->marks.off.v, 2 * b->marks.off.cap * sizeof(*b->marks.off.v));
+    buf_mem_free(b, b->marks.slot, b->marks.nslot * sizeof(*b->marks.slot));
+    memset(&b->marks, 0, sizeof(b->marks));
+#endif
+#ifdef BUF_USE_UNDO
+    buf_mem_free(b, b->undo.data, b->undo.cap);
+    memset(&b->undo, 0, sizeof(b->undo));
+#endif
+#ifdef BUF_USE_DAMAGE
+    memset(&b->damage, 0, sizeof(b->damage));
+#endif
+#ifdef BUF_USE_OBSERVE
+    buf_mem_free(b, b->obs.v, b->obs.cap * sizeof(*b->obs.v));
+    memset(&b->obs, 0, sizeof(b->obs));
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void *buf_std_alloc(void *ctx, size_t n)
+{
+    (void)ctx;
+    return malloc(n);
+}
+
+static void *buf_std_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    (void)ctx; (void)old;
+    return realloc(p, n);
+}
+
+static void buf_std_free(void *ctx, void *p, size_t n)
+{
+    (void)ctx; (void)n;
+    free(p);
+}
+
+static const buf_allocator buf_std_allocator = {
+    buf_std_alloc, buf_std_realloc, buf_std_free, NULL
+};
+static const buf_growth buf_std_growth = { BUF_INIT_SIZE, 200, 0, 0, NULL, NULL };
+
+static const buf_allocator *buf_default_allocator = &buf_std_allocator;
+static const buf_growth *buf_default_growth = &buf_std_growth;
+
+void buf_set_default_allocator(const buf_allocator *a)
+{
+    buf_default_allocator = a ? a : &buf_std_allocator;
+}
+
+void buf_set_default_growth(const buf_growth *g)
+{
+    buf_default_growth = g ? g : &buf_std_growth;
+}
+
+int buf_set_allocator(Buffer *b, const buf_allocator *a)
+{
+    if (!b || (b->data && !(b->flags & BUF_F_BORROWED)))
+        return 0;
+#ifdef BUF_USE_CHUNKS
+    if (b->chunks.off.v || b->chunks.spare || b->chunks.scratch)
+        return 0;
+#endif
+#ifdef BUF_USE_FREEZE
+    if (b->frz.z)
+        return 0;
+#endif
+#ifdef BUF_USE_LINES
+    if (b->lines.v)
+        return 0;
+#endif
+#ifdef BUF_USE_UTF8
+    if (b->utf8.off.v || b->utf8.cnt.v)
+        return 0;
+#endif
+#ifdef BUF_USE_MARKS
+    if (b->marks.off.v || b->marks.slot)
+        return 0;
+#endif
+#ifdef BUF_USE_OBSERVE
+    if (b->obs.v)
+        return 0;
+#endif
+#ifdef BUF_USE_UNDO
+    if (b->undo.data)
+        return 0;
+#endif
+    b->alloc = a;
+    return 1;
+}
+
+void buf_set_growth(Buffer *b, const buf_growth *g)
+{
+    if (b)
+        b->growth = g;
+}
+
+static const buf_growth *buf_growth_of(const Buffer *b)
+{
+    return b->growth ? b->growth : buf_default_growth;
+}
+
+static size_t buf_growth_init(const buf_growth *g)
+{
+    return g->init ? g->init : buf_std_growth.init;
+}
+
+static void *buf_mem_realloc(const Buffer *b, void *p, size_t old, size_t n)
+{
+    const buf_allocator *a = b->alloc ? b->alloc : buf_default_allocator;
+    return p ? a->realloc(a->ctx, p, old, n) : a->alloc(a->ctx, n);
+}
+
+static void buf_mem_free(const Buffer *b, void *p, size_t n)
+{
+    const buf_allocator *a = b->alloc ? b->alloc : buf_default_allocator;
+    if (p)
+        a->free(a->ctx, p, n);
+}
+
+#ifdef BUF_USE_SLAB
+/* class of n bytes, BUF_SLAB_CLASSES if it has none */
+static unsigned buf_slab_class(size_t n)
+{
+    unsigned c;
+
+    for (c = 0; c < BUF_SLAB_CLASSES && n > (size_t)1 << (BUF_SLAB_MIN_SHIFT + c); ++c);
+    return c;
+}
+
+static void *buf_slab_alloc(void *ctx, size_t n)
+{
+    buf_slab *s = (buf_slab *)ctx;
+    unsigned c;
+    void *p;
+
+    if ((c = buf_slab_class(n)) == BUF_SLAB_CLASSES)
+        return malloc(n);
+    if ((p = s->free[c])) {
+        s->free[c] = *(void **)p;
+        s->cached -= (size_t)1 << (BUF_SLAB_MIN_SHIFT + c);
+        return p;
+    }
+    return malloc((size_t)1 << (BUF_SLAB_MIN_SHIFT + c));
+}
+
+static void buf_slab_free(void *ctx, void *p, size_t n)
+{
+    buf_slab *s = (buf_slab *)ctx;
+    unsigned c;
+    size_t sz;
+
+    c = buf_slab_class(n);
+    sz = (size_t)1 << (BUF_SLAB_MIN_SHIFT + c);
+    if (c == BUF_SLAB_CLASSES || (s->max_cached && s->cached + sz > s->max_cached)) {
+        free(p);
+        return;
+    }
+    *(void **)p = s->free[c];
+    s->free[c] = p;
+    s->cached += sz;
+}
+
+static void *buf_slab_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    unsigned c;
+    void *q;
+
+    c = buf_slab_class(n);
+    if (c == buf_slab_class(old))
+        return c == BUF_SLAB_CLASSES ? realloc(p, n) : p;
+    if (!(q = buf_slab_alloc(ctx, n)))
+        return NULL;
+    memcpy(q, p, old < n ? old : n);
+    buf_slab_free(ctx, p, old);
+    return q;
+}
+
+void buf_slab_init(buf_slab *s, size_t max_cached)
+{
+    if (!s)
+        return;
+    memset(s, 0, sizeof(*s));
+    s->alloc.alloc = buf_slab_alloc;
+    s->alloc.realloc = buf_slab_realloc;
+    s->alloc.free = buf_slab_free;
+    s->alloc.ctx = s;
+    s->max_cached = max_cached;
+}
+
+size_t buf_slab_trim(buf_slab *s, size_t keep)
+{
+    size_t sz, freed;
+    unsigned c;
+    void *p;
+
+    if (!s)
+        return 0;
+    for (freed = 0, c = BUF_SLAB_CLASSES; c-- && s->cached > keep;) {
+        sz = (size_t)1 << (BUF_SLAB_MIN_SHIFT + c);
+        while (s->cached > keep && (p = s->free[c])) {
+            s->free[c] = *(void **)p;
+            free(p);
+            s->cached -= sz;
+            freed += sz;
+        }
+    }
+#ifdef __GLIBC__
+    /* free() alone keeps the heap's pages mapped */
+    if (freed)
+        malloc_trim(0);
+#endif
+    return freed;
+}
+
+void buf_slab_destroy(buf_slab *s)
+{
+    buf_slab_trim(s, 0);
+}
+#endif /* BUF_USE_SLAB */
+
+#ifndef BUF_USE_CHUNKS
+/* smallest capacity >= need the policy allows, starting from cap */
+static size_t buf_grow_cap(const Buffer *b, size_t cap, size_t need)
+{
+    const buf_growth *g;
+    unsigned factor;
+    size_t step;
+
+    g = buf_growth_of(b);
+    if (g->grow)
+        return g->grow(g->ctx, cap, need);
+    cap = cap ? cap : buf_growth_init(g);
+    factor = g->factor > 100 ? g->factor : buf_std_growth.factor;
+    while (cap < need) {
+        step = cap / 100 * (factor - 100) + cap % 100 * (factor - 100) / 100;
+        step = step ? step : 1;
+        if (g->max_step && step >= g->max_step) {
+            step = g->max_step;
+            cap += (need - cap + step - 1) / step * step;
+            break;
+        }
+        cap += step;
+    }
+    return cap;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+/* Instrumentation. BUF_STAT(x) compiles to x only with BUF_USE_STATS, and
+ * BUF_STAT_CLOCK()/BUF_STAT_TIME() only with BUF_STATS_TIMING, so they
+ * cost nothing otherwise. */
+#ifdef BUF_USE_STATS
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define BUF_TLS thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define BUF_TLS _Thread_local
+#elif defined(__GNUC__)
+#define BUF_TLS __thread
+#else
+#define BUF_TLS
+#endif
+
+static BUF_TLS buf_stats buf_tstats;
+
+#define BUF_STAT(x) (x)
+
+static inline void buf_stats_cap(size_t cap)
+{
+    if (cap > buf_tstats.peak_capacity)
+        buf_tstats.peak_capacity = cap;
+}
+
+void buf_stats_get(buf_stats *out)
+{
+    if (out)
+        *out = buf_tstats;
+}
+
+void buf_stats_reset(void)
+{
+    memset(&buf_tstats, 0, sizeof(buf_tstats));
+}
+#else
+#define BUF_STAT(x) ((void)0)
+#endif /* BUF_USE_STATS */
+
+#if defined(BUF_USE_STATS) && defined(BUF_STATS_TIMING)
+static inline void buf_stats_hist(uint64_t *h, uint64_t c)
+{
+    int i;
+
+    for (i = 0; c > 1 && i < BUF_STATS_BUCKETS - 1; c >>= 1)
+        ++i;
+    ++h[i];
+}
+
+#define BUF_STAT_CLOCK(t) uint64_t t = BUF_CYCLES()
+#define BUF_STAT_TIME(h, t) buf_stats_hist(buf_tstats.h, BUF_CYCLES() - (t))
+#else
+#define BUF_STAT_CLOCK(t)
+#define BUF_STAT_TIME(h, t) ((void)0)
+#endif
+/*---------------------------------------------------------------------------*/
+/* Invariants:
+ *   0 <= gap_start <= gap_end <= capacity
+ *   Text length = capacity - (gap_end - gap_start)
+ *   cursor <= text length
+ * Motions only move the cursor; the gap is moved to it by the next edit,
+ * so navigating alone never memmoves.
+ * Positions are byte offsets; see BUF_USE_UTF8 for codepoints, and
+ * "Chunked storage" for how BUF_USE_CHUNKS keeps the text. */
+static void buf_assert(const Buffer *b);
+static int buf_move_gap(Buffer *b, size_t pos);
+static int buf_reserve(Buffer *b, size_t new_size);
+#ifndef BUF_USE_CHUNKS
+static size_t buf_gap_len(const Buffer *b);
+#endif
+static int buf_will_insert(Buffer *b, const uint8_t *s, size_t n);
+static void buf_will_delete(Buffer *b, size_t pos, size_t n);
+
+static void buf_assert(const Buffer *b)
+{
+    assert(b);
+    assert(b->gap_start <= b->gap_end);
+    assert(b->gap_end <= b->capacity);
+    assert(b->cursor <= buf_len(b));
+#ifdef BUF_USE_CHUNKS
+    assert(!b->data && b->gap_start == b->gap_end);
+#else
+    assert(b->data || b->capacity == 0);
+#endif
+}
+
+#ifndef BUF_USE_CHUNKS
+/* Copy the text to a block of cap bytes of our own, off snapshot or
+ * inline storage. */
+static int buf_relocate(Buffer *b, size_t cap)
+{
+    size_t tail;
+    uint8_t *p;
+
+    if (!(p = buf_mem_realloc(b, NULL, 0, cap)))
+        return 0;
+    tail = b->capacity - b->gap_end;
+    if (b->data) {
+        memcpy(p, b->data, b->gap_start);
+        memcpy(p + cap - tail, b->data + b->gap_end, tail);
+    }
+    BUF_STAT(++buf_tstats.reallocs);
+    BUF_STAT(buf_tstats.memmove_bytes += b->gap_start + tail);
+    BUF_STAT(buf_stats_cap(cap));
+    buf_release(b);
+    b->flags &= ~(BUF_F_MAPPED | BUF_F_FILE | BUF_F_BORROWED);
+    b->data = p;
+    b->gap_end = cap - tail;
+    b->capacity = cap;
+    return 1;
+}
+#endif
+
+#ifdef BUF_USE_SNAPSHOT
+/* Storage handed to snapshots, freed by whoever drops the last ref. */
+struct buf_share {
+    size_t refs;
+    uint8_t *data;
+    size_t capacity;
+    unsigned flags;
+};
+
+typedef struct {
+    Buffer b; /* what buf_snapshot() hands out */
+    struct buf_share *share;
+} buf_snap;
+
+static void buf_share_drop(const Buffer *b, struct buf_share *sh)
+{
+    if (__atomic_sub_fetch(&sh->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+#ifdef BUF_USE_POSIX
+    if (sh->flags & BUF_F_MAPPED)
+        munmap(sh->data, sh->capacity);
+    else
+#endif
+    buf_mem_free(b, sh->data, sh->capacity);
+    buf_mem_free(b, sh, sizeof(*sh));
+}
+
+/* about to write data[from, to) */
+static int buf_own(Buffer *b, size_t from, size_t to)
+{
+    if (!b->snap.share || from >= to || (b->snap.lo <= from && to <= b->snap.hi))
+        return 1;
+    return buf_relocate(b, b->capacity);
+}
+#endif /* BUF_USE_SNAPSHOT */
+
+/* 0 only if the gap could not be moved off snapshot storage */
+static int buf_move_gap(Buffer *b, size_t pos)
+{
+#ifdef BUF_USE_CHUNKS
+    /* nothing to move: the edit goes straight into the chunk at pos */
+    b->gap_start = b->gap_end = pos;
+    return 1;
+#else
+    size_t n;
+    if (!BUF_THAW(b))
+        return 0;
+    if (pos == b->gap_start)
+        return 1;
+
+#ifdef BUF_USE_SNAPSHOT
+    if (pos < b->gap_start ? !buf_own(b, b->gap_end - (b->gap_start - pos), b->gap_end)
+            : !buf_own(b, b->gap_start, pos))
+        return 0;
+#endif
+    BUF_STAT_CLOCK(t);
+    if (pos < b->gap_start) {
+        n = b->gap_start - pos;
+        memmove(b->data + b->gap_end - n, b->data + pos, n);
+        b->gap_end -= n;
+        b->gap_start -= n;
+    } else {
+        n = pos - b->gap_start;
+        memmove(b->data + b->gap_start, b->data + b->gap_end, n);
+        b->gap_start += n;
+        b->gap_end += n;
+    }
+    BUF_STAT(++buf_tstats.gap_moves);
+    BUF_STAT(buf_tstats.gap_move_bytes += n);
+    BUF_STAT(buf_tstats.memmove_bytes += n);
+    BUF_STAT_TIME(move_cycles, t);
+    return 1;
+#endif
+}
+
+#if defined(BUF_USE_POSIX) && !defined(BUF_USE_CHUNKS)
+#ifdef MREMAP_MAYMOVE
+/* Move the text after the gap up by ncap - capacity, once data already
+ * spans ncap bytes. Whole pages are remapped, not copied, when capacity
+ * and ncap are page multiples and source and target do not overlap.
+ * 0 if pages that moved could not be put back, which leaves a hole. */
+static int buf_move_tail(Buffer *b, size_t ncap, size_t page)
+{
+    size_t tail, delta, from, n;
+    uint8_t *q, *src, *dst;
+
+    tail = b->capacity - b->gap_end;
+    delta = ncap - b->capacity;
+    from = (b->gap_end + page - 1) / page * page;
+    n = b->capacity - from;
+    src = b->data + from;
+    dst = src + delta;
+    /* q is mapped first to fill the hole the pages leave behind (gap
+     * then), so running out of memory costs a copy and nothing else */
+    if (from < b->capacity && delta >= n && !(delta % page)
+            && (q = (uint8_t *)mmap(NULL, n, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED) {
+        if (mremap(src, n, n, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED) {
+            munmap(q, n);
+        } else if (mremap(q, n, n, MREMAP_MAYMOVE | MREMAP_FIXED, src) != MAP_FAILED) {
+            tail = from - b->gap_end;
+        } else if (mremap(dst, n, n, MREMAP_MAYMOVE | MREMAP_FIXED, src) == MAP_FAILED
+                || mremap(q, n, n, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED) {
+            return 0;
+        }
+    }
+    memmove(b->data + b->gap_end + delta, b->data + b->gap_end, tail);
+    BUF_STAT(buf_tstats.memmove_bytes += tail);
+    b->gap_end += delta;
+    b->capacity = ncap;
+    return 1;
+}
+#endif /* MREMAP_MAYMOVE */
+
+/* Grow into mmap()ed storage: in place with mremap() where possible,
+ * otherwise into a fresh mapping (or the heap, for a small mapped file).
+ * File mappings are always copied, mremap() would extend them past EOF. */
+static int buf_reserve_mapped(Buffer *b, size_t ncap)
+{
+    size_t page, tail, nend;
+    uint8_t *p;
+    int map;
+
+    page = sysconf(_SC_PAGESIZE);
+    ncap = (ncap + page - 1) / page * page;
+#ifdef MREMAP_MAYMOVE
+    if ((b->flags & (BUF_F_MAPPED | BUF_F_FILE)) == BUF_F_MAPPED) {
+        p = mremap(b->data, b->capacity, ncap, MREMAP_MAYMOVE);
+        if (p != MAP_FAILED) {
+            BUF_STAT(++buf_tstats.reallocs);
+            b->data = p;
+#ifdef BUF_MMAP_HUGEPAGE
+            madvise(p, ncap, MADV_HUGEPAGE);
+#endif
+            return buf_move_tail(b, ncap, page);
+        }
+    }
+#endif
+    map = ncap >= BUF_MMAP_THRESHOLD
+        && (b->alloc ? b->alloc : buf_default_allocator) == &buf_std_allocator;
+    if (map) {
+        p = mmap(NULL, ncap, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return 0;
+#ifdef BUF_MMAP_HUGEPAGE
+        madvise(p, ncap, MADV_HUGEPAGE);
+#endif
+    } else if (!(p = buf_mem_realloc(b, NULL, 0, ncap))) {
+        return 0;
+    }
+    tail = b->capacity - b->gap_end;
+    nend = ncap - tail;
+    memcpy(p, b->data, b->gap_start);
+    memcpy(p + nend, b->data + b->gap_end, tail);
+    BUF_STAT(++buf_tstats.reallocs);
+    BUF_STAT(buf_tstats.memmove_bytes += b->gap_start + tail);
+    buf_release(b);
+    b->flags &= ~(BUF_F_MAPPED | BUF_F_FILE | BUF_F_BORROWED);
+    b->flags |= map ? BUF_F_MAPPED : 0;
+    b->data = p;
+    b->gap_end = nend;
+    b->capacity = ncap;
+    return 1;
+}
+#endif /* BUF_USE_POSIX && !BUF_USE_CHUNKS */
+
+static int buf_reserve(Buffer *b, size_t new_size)
+{
+#ifdef BUF_USE_CHUNKS
+    return buf_chunk_reserve(b, new_size);
+#else
+    size_t ncap;
+    uint8_t *p;
+
+    if (!BUF_THAW(b))
+        return 0;
+#ifdef BUF_USE_SNAPSHOT
+    if (buf_gap_len(b) >= new_size)
+        return buf_own(b, b->gap_start, b->gap_start + new_size);
+#else
+    if (buf_gap_len(b) >= new_size)
+        return 1;
+#endif
+    size_t buflen = buf_len(b);
+    ncap = buf_grow_cap(b, b->capacity, buflen + new_size);
+    if (ncap < buflen + new_size)
+        return 0;
+    BUF_STAT_CLOCK(t);
+
+#ifdef BUF_USE_SNAPSHOT
+    if (b->snap.share)
+        return buf_relocate(b, ncap);
+#endif
+    if (b->flags & BUF_F_BORROWED)
+        return buf_relocate(b, ncap);
+
+#ifdef BUF_USE_POSIX
+    if ((b->flags & BUF_F_MAPPED) || (ncap >= BUF_MMAP_THRESHOLD
+                && (b->alloc ? b->alloc : buf_default_allocator) == &buf_std_allocator)) {
+        if (!buf_reserve_mapped(b, ncap))
+            return 0;
+        BUF_STAT(buf_stats_cap(b->capacity));
+        BUF_STAT_TIME(reserve_cycles, t);
+        return 1;
+    }
+#endif
+
+    size_t n, nend;
+    n = b->capacity - b->gap_end;
+    nend = ncap - n;
+    p = buf_mem_realloc(b, b->data, b->capacity, ncap);
+    if (!p)
+        return 0;
+    b->data = p;
+
+    memmove(b->data + nend, b->data + b->gap_end, n);
+    BUF_STAT(++buf_tstats.reallocs);
+    BUF_STAT(buf_tstats.realloc_bytes += b->capacity);
+    BUF_STAT(buf_tstats.memmove_bytes += n);
+    BUF_STAT(buf_stats_cap(ncap));
+    b->gap_end = nend;
+    b->capacity = ncap;
+    BUF_STAT_TIME(reserve_cycles, t);
+
+    return 1;
+#endif
+}
+
+static void buf_release(Buffer *b)
+{
+#ifdef BUF_USE_SNAPSHOT
+    if (b->snap.share) {
+        buf_share_drop(b, b->snap.share);
+        b->snap.share = NULL;
+        return;
+    }
+#endif
+#ifdef BUF_USE_POSIX
+    if (b->flags & BUF_F_MAPPED) {
+        munmap(b->data, b->capacity);
+        return;
+    }
+#endif
+    if (b->flags & BUF_F_BORROWED)
+        return;
+    buf_mem_free(b, b->data, b->capacity);
+}
+
+/* Shrink the gap to reserve bytes and hand the rest back. */
+static int buf_compact(Buffer *b, size_t reserve)
+{
+#ifdef BUF_USE_CHUNKS
+    /* there is no gap, only the spare chunks and scratch to give back */
+    (void)reserve;
+    buf_chunk_trim(b);
+    return 1;
+#else
+    size_t len, tail, ncap;
+    uint8_t *p;
+
+    if (buf_gap_len(b) <= reserve || (b->flags & (BUF_F_MAPPED | BUF_F_BORROWED)))
+        return 1;
+    len = buf_len(b);
+    if (!len && !reserve) {
+        buf_release(b);
+        b->data = NULL;
+        b->capacity = b->gap_start = b->gap_end = 0;
+        return 1;
+    }
+    ncap = len + reserve;
+#ifdef BUF_USE_SNAPSHOT
+    if (b->snap.share)
+        return buf_relocate(b, ncap);
+#endif
+    tail = b->capacity - b->gap_end;
+    memmove(b->data + ncap - tail, b->data + b->gap_end, tail);
+    b->gap_end = ncap - tail;
+    BUF_STAT(buf_tstats.memmove_bytes += tail);
+    BUF_STAT(++buf_tstats.reallocs);
+    BUF_STAT(buf_tstats.realloc_bytes += ncap);
+    p = buf_mem_realloc(b, b->data, b->capacity, ncap);
+    if (p)
+        b->data = p;
+    /* a failed shrink still leaves valid (if oversized) storage */
+    b->capacity = p ? ncap : b->capacity;
+    if (!p) {
+        memmove(b->data + b->capacity - tail, b->data + b->gap_end, tail);
+        b->gap_end = b->capacity - tail;
+    }
+    return p != NULL;
+#endif
+}
+
+int buf_shrink_to_fit(Buffer *b)
+{
+    buf_assert(b);
+    return b ? buf_compact(b, 0) : 0;
+}
+
+#ifdef BUF_USE_SLAB
+size_t buf_compact_idle(Buffer *b, size_t reserve)
+{
+    size_t cap;
+
+    buf_assert(b);
+    if (!b)
+        return 0;
+    if (b->touched) {
+        b->touched = 0;
+        return 0;
+    }
+#ifdef BUF_USE_CHUNKS
+    cap = b->chunks.nspare * BUF_CHUNK_SIZE + b->chunks.nscratch;
+    buf_compact(b, reserve);
+    return cap;
+#else
+    cap = b->capacity;
+    buf_compact(b, reserve);
+    return cap - b->capacity;
+#endif
+}
+#endif /* BUF_USE_SLAB */
+
+#ifndef BUF_USE_CHUNKS
+static size_t buf_gap_len(const Buffer *b)
+{
+    return b->gap_end - b->gap_start;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+/* Cold storage. The codec is LZ77 in LZ4's layout: each sequence is a
+ * token (literal count << 4 | match length - 4), the count's extension
+ * bytes, the literals, a 2 byte little endian offset, the length's
+ * extension bytes; a 15 in either nibble continues in bytes that add up
+ * until one is not 255. The last sequence has literals only. */
+#ifdef BUF_USE_FREEZE
+#define BUF_LZ_HASH 12
+#define BUF_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+static uint32_t buf_lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - BUF_LZ_HASH);
+}
+
+static uint8_t *buf_lz_put_len(uint8_t *op, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+static int buf_lz_get_len(const uint8_t **ip, const uint8_t *end, size_t *n)
+{
+    uint8_t c;
+
+    do {
+        if (*ip >= end)
+            return 0;
+        c = *(*ip)++;
+        *n += c;
+    } while (c == 255);
+    return 1;
+}
+
+static uint8_t *buf_lz_seq(uint8_t *op, const uint8_t *lit, size_t nlit)
+{
+    *op = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    op = nlit < 15 ? op + 1 : buf_lz_put_len(op + 1, nlit - 15);
+    memcpy(op, lit, nlit);
+    return op + nlit;
+}
+
+/* Compress in[0, n) into out, which holds BUF_LZ_BOUND(n) bytes. Greedy,
+ * one hash probe per position, and the step grows while nothing matches
+ * so incompressible text passes quickly. */
+static size_t buf_lz_pack(const uint8_t *in, size_t n, uint8_t *out)
+{
+    size_t tab[1 << BUF_LZ_HASH];
+    const uint8_t *ip, *anchor, *ref, *end, *limit;
+    uint8_t *op, *tok;
+    size_t h, len, miss;
+
+    memset(tab, 0, sizeof(tab));
+    ip = anchor = in;
+    end = in + n;
+    limit = n > 12 ? end - 12 : in; /* the tail stays literal */
+    op = out;
+    for (miss = 0; ip < limit;) {
+        h = buf_lz_hash(ip);
+        ref = in + tab[h];
+        tab[h] = ip - in;
+        if (ref >= ip || ip - ref > 0xffff || memcmp(ref, ip, 4)) {
+            ip += 1 + (miss++ >> 6);
+            continue;
+        }
+        miss = 0;
+        for (; ip > anchor && ref > in && ip[-1] == ref[-1]; --ip, --ref);
+        for (len = 4; ip + len < limit && ip[len] == ref[len]; ++len);
+
+        tok = op;
+        op = buf_lz_seq(op, anchor, ip - anchor);
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        *tok |= len - 4 < 15 ? len - 4 : 15;
+        if (len - 4 >= 15)
+            op = buf_lz_put_len(op, len - 4 - 15);
+        ip += len;
+        anchor = ip;
+    }
+    op = buf_lz_seq(op, anchor, end - anchor);
+    return op - out;
+}
+
+/* 1 if in[0, n) holds exactly len bytes' worth of sequences */
+static int buf_lz_unpack(const uint8_t *in, size_t n, uint8_t *out, size_t len)
+{
+    const uint8_t *ip, *iend;
+    uint8_t *op, *oend;
+    size_t nlit, mlen, off, i;
+    uint8_t t;
+
+    ip = in;
+    iend = in + n;
+    op = out;
+    oend = out + len;
+    while (ip < iend) {
+        t = *ip++;
+        nlit = t >> 4;
+        if (nlit == 15 && !buf_lz_get_len(&ip, iend, &nlit))
+            return 0;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return 0;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            return op == oend;
+        if (iend - ip < 2)
+            return 0;
+        off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        mlen = t & 15;
+        if (mlen == 15 && !buf_lz_get_len(&ip, iend, &mlen))
+            return 0;
+        mlen += 4;
+        if (!off || off > (size_t)(op - out) || mlen > (size_t)(oend - op))
+            return 0;
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+        } else {
+            for (i = 0; i < mlen; ++i)
+                op[i] = op[i - off];
+        }
+        op += mlen;
+    }
+    return 0;
+}
+
+static void buf_frz_drop(Buffer *b)
+{
+    if (!b->frz.z)
+        return;
+    buf_mem_free(b, b->frz.z, b->frz.zlen);
+    b->frz.z = NULL;
+    b->frz.zlen = b->frz.len = 0;
+}
+
+int buf_freeze(Buffer *b)
+{
+    size_t len, zlen, bound;
+    uint8_t *z, *p;
+
+    buf_assert(b);
+    if (!b || (b->flags & BUF_F_BORROWED))
+        return 0;
+    if (b->frz.z)
+        return 1;
+    len = buf_len(b);
+    if (!len || !buf_move_gap(b, len))
+        return 0;
+    bound = BUF_LZ_BOUND(len);
+    if (!(z = (uint8_t *)buf_mem_realloc(b, NULL, 0, bound)))
+        return 0;
+    zlen = buf_lz_pack(b->data, len, z);
+    if (zlen > len - len / 8 || !(p = (uint8_t *)buf_mem_realloc(b, z, bound, zlen))) {
+        buf_mem_free(b, z, bound);
+        return 0;
+    }
+    buf_release(b);
+    b->flags &= ~(BUF_F_MAPPED | BUF_F_FILE);
+    b->data = NULL;
+    b->capacity = b->gap_start = b->gap_end = 0;
+    b->frz.z = p;
+    b->frz.zlen = zlen;
+    b->frz.len = len;
+    return 1;
+}
+
+int buf_thaw(Buffer *b)
+{
+    size_t len, cap;
+    uint8_t *p;
+
+    buf_assert(b);
+    if (!b)
+        return 0;
+    if (!b->frz.z)
+        return 1;
+    len = b->frz.len;
+    cap = buf_grow_cap(b, 0, len);
+    if (cap < len || !(p = (uint8_t *)buf_mem_realloc(b, NULL, 0, cap)))
+        return 0;
+    if (!buf_lz_unpack(b->frz.z, b->frz.zlen, p, len)) {
+        buf_mem_free(b, p, cap);
+        return 0;
+    }
+    buf_frz_drop(b);
+    b->data = p;
+    b->capacity = b->gap_end = cap;
+    b->gap_start = len;
+    BUF_STAT(buf_stats_cap(cap));
+    buf_lru_touch(b);
+    buf_assert(b);
+    return 1;
+}
+
+int buf_frozen(const Buffer *b)
+{
+    return b && b->frz.z;
+}
+
+void buf_lru_add(buf_lru *l, Buffer *b)
+{
+    if (!l || !b)
+        return;
+    buf_lru_remove(b);
+    b->frz.lru = l;
+    b->frz.next = l->head;
+    if (l->head)
+        l->head->frz.prev = b;
+    else
+        l->tail = b;
+    l->head = b;
+}
+
+void buf_lru_remove(Buffer *b)
+{
+    buf_lru *l;
+
+    if (!b || !(l = b->frz.lru))
+        return;
+    if (b->frz.prev)
+        b->frz.prev->frz.next = b->frz.next;
+    else
+        l->head = b->frz.next;
+    if (b->frz.next)
+        b->frz.next->frz.prev = b->frz.prev;
+    else
+        l->tail = b->frz.prev;
+    b->frz.lru = NULL;
+    b->frz.prev = b->frz.next = NULL;
+}
+
+void buf_lru_touch(Buffer *b)
+{
+    if (b && b->frz.lru && b->frz.lru->head != b)
+        buf_lru_add(b->frz.lru, b);
+}
+
+size_t buf_lru_freeze(buf_lru *l, size_t keep)
+{
+    Buffer *b, *prev;
+    size_t total, saved, cap;
+
+    if (!l)
+        return 0;
+    for (total = 0, b = l->head; b; b = b->frz.next)
+        total += b->capacity;
+    saved = 0;
+    for (b = l->tail; b && total > keep; b = prev) {
+        prev = b->frz.prev;
+        cap = b->capacity;
+        if (!cap || !buf_freeze(b))
+            continue;
+        total -= cap;
+        saved += cap - b->frz.zlen;
+    }
+    return saved;
+}
+#endif /* BUF_USE_FREEZE */
+/*---------------------------------------------------------------------------*/
+/* Offset vectors. 'total' is the length the stored offsets are relative
+ * to and must be the same for every call between two edits.
+ * Splitting costs O(entries crossed), same as moving the text gap. */
+#if defined(BUF_USE_LINES) || defined(BUF_USE_UTF8) || defined(BUF_USE_MARKS) \
+    || defined(BUF_USE_CHUNKS)
+static size_t buf_offv_len(const buf_offv *o)
+{
+    return o->lo + (o->cap - o->hi);
+}
+
+static size_t buf_offv_at(const buf_offv *o, size_t i, size_t total)
+{
+    return i < o->lo ? o->v[i] : total - o->v[i + (o->hi - o->lo)];
+}
+#endif
+
+#if defined(BUF_USE_LINES) || defined(BUF_USE_UTF8)
+
+static int buf_offv_reserve(const Buffer *b, buf_offv *o, size_t n)
+{
+    size_t ncap, cnt, tail;
+    size_t *p;
+
+    if (o->hi - o->lo >= n)
+        return 1;
+    cnt = buf_offv_len(o);
+    ncap = o->cap ? o->cap : 64;
+    while (ncap - cnt < n)
+        ncap *= 2;
+    p = buf_mem_realloc(b, o->v, o->cap * sizeof(*p), ncap * sizeof(*p));
+    if (!p)
+        return 0;
+    o->v = p;
+
+    tail = o->cap - o->hi;
+    memmove(o->v + ncap - tail, o->v + o->hi, tail * sizeof(*p));
+    o->hi = ncap - tail;
+    o->cap = ncap;
+    return 1;
+}
+
+/* move the gap so that exactly the entries < pos are before it */
+static void buf_offv_split(buf_offv *o, size_t pos, size_t total)
+{
+    while (o->lo && o->v[o->lo - 1] >= pos) {
+        --o->lo;
+        o->v[--o->hi] = total - o->v[o->lo];
+    }
+    while (o->hi < o->cap && total - o->v[o->hi] < pos) {
+        o->v[o->lo++] = total - o->v[o->hi];
+        ++o->hi;
+    }
+}
+
+#ifdef BUF_USE_UTF8
+/* move the gap so that exactly i entries are before it */
+static void buf_offv_split_at(buf_offv *o, size_t i, size_t total)
+{
+    while (o->lo > i) {
+        --o->lo;
+        o->v[--o->hi] = total - o->v[o->lo];
+    }
+    while (o->lo < i) {
+        o->v[o->lo++] = total - o->v[o->hi];
+        ++o->hi;
+    }
+}
+#endif
+
+/* drop entries in [from, to); the range must not straddle the gap */
+static void buf_offv_erase(buf_offv *o, size_t from, size_t to, size_t total)
+{
+    while (o->lo && o->v[o->lo - 1] >= from && o->v[o->lo - 1] < to)
+        --o->lo;
+    while (o->hi < o->cap && total - o->v[o->hi] >= from
+            && total - o->v[o->hi] < to)
+        ++o->hi;
+}
+#endif
+
+#if defined(BUF_USE_LINES) || defined(BUF_USE_UTF8) || defined(BUF_USE_MARKS) \
+    || defined(BUF_USE_CHUNKS)
+/* number of entries < pos */
+static size_t buf_offv_rank(const buf_offv *o, size_t pos, size_t total)
+{
+    size_t l, r, m;
+
+    l = 0;
+    r = buf_offv_len(o);
+    while (l < r) {
+        m = l + (r - l) / 2;
+        if (buf_offv_at(o, m, total) < pos)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return l;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+/* Chunked storage. The text is cut into chunks of at most BUF_CHUNK_SIZE
+ * bytes, none of them empty, each a block of its own. chunks.off holds
+ * where each one starts (it ends where the next one starts) and
+ * chunks.ptr, entry for entry, its bytes; both are split at the same
+ * index, next to the last edit. An edit then costs a memmove inside one
+ * chunk, a few chunks copied when it splits or merges them, and the
+ * entries crossed since the previous edit, however long the text is.
+ * Buffer's own gap stays empty at the last edit, data is NULL and
+ * capacity is the text length, so buf_len() and the edit hooks work
+ * unchanged. */
+#ifdef BUF_USE_CHUNKS
+#define BUF_CHUNK_SPARE 4 /* free chunks kept around for the next edits */
+#define BUF_CHUNK_ENTRY (sizeof(size_t) + sizeof(uint8_t *))
+
+static size_t buf_chunk_count(const Buffer *b)
+{
+    return buf_offv_len(&b->chunks.off);
+}
+
+static uint8_t *buf_chunk_ptr(const Buffer *b, size_t i)
+{
+    const buf_offv *o = &b->chunks.off;
+
+    return b->chunks.ptr[i < o->lo ? i : i + (o->hi - o->lo)];
+}
+
+static size_t buf_chunk_start(const Buffer *b, size_t i)
+{
+    return buf_offv_at(&b->chunks.off, i, b->capacity);
+}
+
+static size_t buf_chunk_end(const Buffer *b, size_t i)
+{
+    return i + 1 < buf_chunk_count(b) ? buf_chunk_start(b, i + 1) : b->capacity;
+}
+
+/* the chunk holding byte pos */
+static size_t buf_chunk_find(const Buffer *b, size_t pos)
+{
+    return buf_offv_rank(&b->chunks.off, pos + 1, b->capacity) - 1;
+}
+
+/* move the gap of both arrays so that exactly i chunks are before it */
+static void buf_chunk_split_at(Buffer *b, size_t i)
+{
+    buf_offv *o = &b->chunks.off;
+    uint8_t **p = b->chunks.ptr;
+    size_t total = b->capacity;
+
+    while (o->lo > i) {
+        --o->lo;
+        --o->hi;
+        o->v[o->hi] = total - o->v[o->lo];
+        p[o->hi] = p[o->lo];
+    }
+    while (o->lo < i) {
+        o->v[o->lo] = total - o->v[o->hi];
+        p[o->lo++] = p[o->hi++];
+    }
+}
+
+/* new chunk at the gap, starting at pos */
+static void buf_chunk_add(Buffer *b, size_t pos, uint8_t *c)
+{
+    b->chunks.off.v[b->chunks.off.lo] = pos;
+    b->chunks.ptr[b->chunks.off.lo++] = c;
+}
+
+static void buf_chunk_push(Buffer *b, uint8_t *c)
+{
+    memcpy(c, &b->chunks.spare, sizeof(c));
+    b->chunks.spare = c;
+    ++b->chunks.nspare;
+}
+
+static uint8_t *buf_chunk_take(Buffer *b)
+{
+    uint8_t *c;
+
+    c = b->chunks.spare;
+    memcpy(&b->chunks.spare, c, sizeof(c));
+    --b->chunks.nspare;
+    return c;
+}
+
+/* a chunk left the text: keep a few for the next edits */
+static void buf_chunk_give(Buffer *b, uint8_t *c)
+{
+    if (b->chunks.nspare < BUF_CHUNK_SPARE)
+        buf_chunk_push(b, c);
+    else
+        buf_mem_free(b, c, BUF_CHUNK_SIZE);
+}
+
+/* Room for an insert of n bytes: table entries and spare chunks enough
+ * that buf_chunk_insert() cannot fail. ptr shares one block with off.v. */
+static int buf_chunk_reserve(Buffer *b, size_t n)
+{
+    buf_offv *o = &b->chunks.off;
+    size_t need, ncap, tail;
+    uint8_t **p, *c;
+    size_t *v;
+
+    need = n / BUF_CHUNK_SIZE + 2;
+    if (o->hi - o->lo < need) {
+        ncap = o->cap ? o->cap : 64;
+        while (ncap - buf_offv_len(o) < need)
+            ncap *= 2;
+        if (!(v = (size_t *)buf_mem_realloc(b, NULL, 0, ncap * BUF_CHUNK_ENTRY)))
+            return 0;
+        p = (uint8_t **)(v + ncap);
+        tail = o->cap - o->hi;
+        if (o->cap) {
+            memcpy(v, o->v, o->lo * sizeof(*v));
+            memcpy(v + ncap - tail, o->v + o->hi, tail * sizeof(*v));
+            memcpy(p, b->chunks.ptr, o->lo * sizeof(*p));
+            memcpy(p + ncap - tail, b->chunks.ptr + o->hi, tail * sizeof(*p));
+            buf_mem_free(b, o->v, o->cap * BUF_CHUNK_ENTRY);
+        }
+        o->v = v;
+        b->chunks.ptr = p;
+        o->hi = ncap - tail;
+        o->cap = ncap;
+    }
+    while (b->chunks.nspare < need) {
+        if (!(c = (uint8_t *)buf_mem_realloc(b, NULL, 0, BUF_CHUNK_SIZE)))
+            return 0;
+        buf_chunk_push(b, c);
+    }
+    return 1;
+}
+
+/* Fold the chunk after the table gap into the one before it when either
+ * is under a quarter full and both fit in one, so that edits do not leave
+ * a trail of slivers behind. */
+static void buf_chunk_merge(Buffer *b)
+{
+    buf_offv *o = &b->chunks.off;
+    size_t a, c;
+
+    if (!o->lo || o->hi == o->cap)
+        return;
+    a = buf_chunk_end(b, o->lo - 1) - buf_chunk_start(b, o->lo - 1);
+    c = buf_chunk_end(b, o->lo) - buf_chunk_start(b, o->lo);
+    if ((a >= BUF_CHUNK_SIZE / 4 && c >= BUF_CHUNK_SIZE / 4) || a + c > BUF_CHUNK_SIZE)
+        return;
+    memcpy(b->chunks.ptr[o->lo - 1] + a, b->chunks.ptr[o->hi], c);
+    BUF_STAT(buf_tstats.memmove_bytes += c);
+    buf_chunk_give(b, b->chunks.ptr[o->hi++]);
+}
+
+/* s[0, n) goes in at pos, into the chunk that ends there if pos is on a
+ * boundary; buf_chunk_reserve(b, n) made room. A chunk too full to take
+ * it is cut at pos: s fills it up and then new chunks, and what came
+ * after pos goes last. */
+static void buf_chunk_insert(Buffer *b, size_t pos, const uint8_t *s, size_t n)
+{
+    buf_offv *o = &b->chunks.off;
+    uint8_t *c, *t;
+    size_t start, len, off, tail, at, k;
+
+    c = t = NULL;
+    start = len = off = 0;
+    if (buf_chunk_count(b)) {
+        buf_chunk_split_at(b, (pos ? buf_chunk_find(b, pos - 1) : 0) + 1);
+        c = b->chunks.ptr[o->lo - 1];
+        start = o->v[o->lo - 1];
+        len = (o->hi < o->cap ? b->capacity - o->v[o->hi] : b->capacity) - start;
+        off = pos - start;
+    }
+    b->capacity += n;
+    if (c && len + n <= BUF_CHUNK_SIZE) {
+        memmove(c + off + n, c + off, len - off);
+        memcpy(c + off, s, n);
+        BUF_STAT(buf_tstats.memmove_bytes += len - off);
+        return;
+    }
+
+    if ((tail = len - off)) {
+        t = buf_chunk_take(b);
+        memcpy(t, c + off, tail);
+        BUF_STAT(buf_tstats.memmove_bytes += tail);
+        len = off;
+    }
+    at = pos;
+    if (c) {
+        k = BUF_CHUNK_SIZE - len < n ? BUF_CHUNK_SIZE - len : n;
+        memcpy(c + len, s, k);
+        len += k;
+        at += k;
+        s += k;
+        n -= k;
+    }
+    for (; n; at += k, s += k, n -= k) {
+        c = buf_chunk_take(b);
+        k = n < BUF_CHUNK_SIZE ? n : BUF_CHUNK_SIZE;
+        memcpy(c, s, k);
+        buf_chunk_add(b, at, c);
+        len = k;
+    }
+    if (t && len + tail <= BUF_CHUNK_SIZE) {
+        memcpy(c + len, t, tail);
+        buf_chunk_give(b, t);
+    } else if (t) {
+        buf_chunk_add(b, at, t);
+    }
+    buf_chunk_merge(b);
+}
+
+/* [pos, pos+n) of the text goes */
+static void buf_chunk_erase(Buffer *b, size_t pos, size_t n)
+{
+    buf_offv *o = &b->chunks.off;
+    uint8_t **p = b->chunks.ptr;
+    size_t total, start, len, off, k;
+
+    total = b->capacity;
+    buf_chunk_split_at(b, buf_chunk_find(b, pos) + 1);
+    start = o->v[o->lo - 1];
+    len = (o->hi < o->cap ? total - o->v[o->hi] : total) - start;
+    off = pos - start;
+    k = n < len - off ? n : len - off;
+    memmove(p[o->lo - 1] + off, p[o->lo - 1] + off + k, len - off - k);
+    BUF_STAT(buf_tstats.memmove_bytes += len - off - k);
+    if (k == len)
+        buf_chunk_give(b, p[--o->lo]);
+    /* the rest comes off the front of the chunks after it */
+    for (k = n - k; k; k -= len) {
+        start = total - o->v[o->hi];
+        len = (o->hi + 1 < o->cap ? total - o->v[o->hi + 1] : total) - start;
+        if (len > k) {
+            memmove(p[o->hi], p[o->hi] + k, len - k);
+            BUF_STAT(buf_tstats.memmove_bytes += len - k);
+            o->v[o->hi] = total - n - pos;
+            break;
+        }
+        buf_chunk_give(b, p[o->hi++]);
+    }
+    b->capacity = total - n;
+    buf_chunk_merge(b);
+}
+
+/* every chunk goes, the text is empty */
+static void buf_chunk_clear(Buffer *b)
+{
+    buf_offv *o = &b->chunks.off;
+    size_t i;
+
+    for (i = 0; i < o->lo; ++i)
+        buf_chunk_give(b, b->chunks.ptr[i]);
+    for (i = o->hi; i < o->cap; ++i)
+        buf_chunk_give(b, b->chunks.ptr[i]);
+    o->lo = 0;
+    o->hi = o->cap;
+}
+
+/* hand the spare chunks and the scratch block back, 0 if there were none */
+static int buf_chunk_trim(Buffer *b)
+{
+    if (!b->chunks.nspare && !b->chunks.nscratch)
+        return 0;
+    while (b->chunks.nspare)
+        buf_mem_free(b, buf_chunk_take(b), BUF_CHUNK_SIZE);
+    buf_mem_free(b, b->chunks.scratch, b->chunks.nscratch);
+    b->chunks.scratch = NULL;
+    b->chunks.nscratch = 0;
+    return 1;
+}
+
+/* free everything the chunks hold */
+static void buf_chunk_drop(Buffer *b)
+{
+    buf_chunk_clear(b);
+    buf_chunk_trim(b);
+    buf_mem_free(b, b->chunks.off.v, b->chunks.off.cap * BUF_CHUNK_ENTRY);
+    memset(&b->chunks, 0, sizeof(b->chunks));
+}
+
+/* [pos, pos+n) copied into one piece, for a buf_view() over more than two
+ * chunks; the next such view reuses it */
+static const uint8_t *buf_chunk_gather(const Buffer *b, size_t pos, size_t n)
+{
+    Buffer *w = (Buffer *)b;
+    uint8_t *p;
+
+    if (n > b->chunks.nscratch) {
+        if (!(p = (uint8_t *)buf_mem_realloc(b, b->chunks.scratch, b->chunks.nscratch, n)))
+            return NULL;
+        w->chunks.scratch = p;
+        w->chunks.nscratch = n;
+    }
+    buf_read(b, pos, w->chunks.scratch, n);
+    return b->chunks.scratch;
+}
+
+#ifdef BUF_USE_POSIX
+/* the text becomes the first len bytes of fd, read into new chunks; 0
+ * with the text unchanged if that failed */
+static int buf_chunk_load(Buffer *b, int fd, size_t len)
+{
+    Buffer t;
+    size_t at, k, got;
+    ssize_t r;
+    uint8_t *c;
+
+    memset(&t, 0, sizeof(t));
+    t.alloc = b->alloc;
+    if (!buf_chunk_reserve(&t, len))
+        goto fail;
+    for (at = 0; at < len; at += k) {
+        c = buf_chunk_take(&t);
+        k = len - at < BUF_CHUNK_SIZE ? len - at : BUF_CHUNK_SIZE;
+        for (got = 0; got < k; got += r) {
+            r = pread(fd, c + got, k - got, at + got);
+            if (r < 0 && errno == EINTR)
+                r = 0;
+            else if (r <= 0)
+                break;
+        }
+        buf_chunk_add(&t, at, c);
+        if (got < k)
+            goto fail;
+    }
+    buf_chunk_clear(b);
+    buf_mem_free(b, b->chunks.off.v, b->chunks.off.cap * BUF_CHUNK_ENTRY);
+    b->chunks.off = t.chunks.off;
+    b->chunks.ptr = t.chunks.ptr;
+    while (t.chunks.nspare)
+        buf_chunk_give(b, buf_chunk_take(&t));
+    b->capacity = len;
+    return 1;
+fail:
+    buf_chunk_drop(&t);
+    return 0;
+}
+#endif
+#endif /* BUF_USE_CHUNKS */
+/*---------------------------------------------------------------------------*/
+/* Byte classes for the scanners. ASCII only, so they agree with
+ * isspace()/isalnum() in the "C" locale; HIGH is every non-ASCII byte,
+ * CONT the UTF-8 continuation bytes. */
+enum { BUF_CLS_NL, BUF_CLS_SPACE, BUF_CLS_ALNUM, BUF_CLS_HIGH, BUF_CLS_CONT };
+
+static inline int buf_cls_test(uint8_t c, int cls)
+{
+    switch (cls) {
+    case BUF_CLS_NL:
+        return c == '\n';
+    case BUF_CLS_SPACE:
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    case BUF_CLS_HIGH:
+        return c >= 0x80;
+    case BUF_CLS_CONT:
+        return (c & 0xc0) == 0x80;
+    default:
+        return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+    }
+}
+
+#ifdef BUF_SIMD_W
+/* Bit mask of the bytes of p[0, BUF_SIMD_W) that are in cls, with
+ * BUF_SIMD_BPB bits per byte. */
+#if defined(BUF_SIMD_AVX2)
+#define BUF_SIMD_BPB 1
+#define BUF_SIMD_FULL 0xffffffffull
+#define BUF_IN_RANGE(x, lo, n) _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (n))), \
+        _mm256_add_epi8((x), _mm256_set1_epi8((char)(0x80 - (lo)))))
+static inline uint64_t buf_cls_mask(const uint8_t *p, int cls)
+{
+    __m256i x, m;
+
+    x = _mm256_loadu_si256((const __m256i *)p);
+    switch (cls) {
+    case BUF_CLS_NL:
+        m = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'));
+        break;
+    case BUF_CLS_SPACE:
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                BUF_IN_RANGE(x, '\t', 5));
+        break;
+    case BUF_CLS_HIGH:
+        m = x;
+        break;
+    case BUF_CLS_CONT:
+        m = BUF_IN_RANGE(x, 0x80, 64);
+        break;
+    default:
+        m = _mm256_or_si256(BUF_IN_RANGE(x, '0', 10),
+                BUF_IN_RANGE(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 26));
+        break;
+    }
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+/* lanes i where p[i] == a and q[i] == z */
+static inline uint64_t buf_eq2_mask(const uint8_t *p, const uint8_t *q, uint8_t a, uint8_t z)
+{
+    __m256i x, y;
+
+    x = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi8((char)a));
+    y = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)q), _mm256_set1_epi8((char)z));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(x, y));
+}
+#elif defined(BUF_SIMD_SSE2)
+#define BUF_SIMD_BPB 1
+#define BUF_SIMD_FULL 0xffffull
+#define BUF_IN_RANGE(x, lo, n) _mm_cmplt_epi8(_mm_add_epi8((x), \
+        _mm_set1_epi8((char)(0x80 - (lo)))), _mm_set1_epi8((char)(-128 + (n))))
+static inline uint64_t buf_cls_mask(const uint8_t *p, int cls)
+{
+    __m128i x, m;
+
+    x = _mm_loadu_si128((const __m128i *)p);
+    switch (cls) {
+    case BUF_CLS_NL:
+        m = _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'));
+        break;
+    case BUF_CLS_SPACE:
+        m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                BUF_IN_RANGE(x, '\t', 5));
+        break;
+    case BUF_CLS_HIGH:
+        m = x;
+        break;
+    case BUF_CLS_CONT:
+        m = BUF_IN_RANGE(x, 0x80, 64);
+        break;
+    default:
+        m = _mm_or_si128(BUF_IN_RANGE(x, '0', 10),
+                BUF_IN_RANGE(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 26));
+        break;
+    }
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+static inline uint64_t buf_eq2_mask(const uint8_t *p, const uint8_t *q, uint8_t a, uint8_t z)
+{
+    __m128i x, y;
+
+    x = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8((char)a));
+    y = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)q), _mm_set1_epi8((char)z));
+    return (unsigned)_mm_movemask_epi8(_mm_and_si128(x, y));
+}
+#elif defined(BUF_SIMD_NEON)
+#define BUF_SIMD_BPB 4
+#define BUF_SIMD_FULL 0xffffffffffffffffull
+#define BUF_IN_RANGE(x, lo, n) vcltq_u8(vsubq_u8((x), vdupq_n_u8(lo)), vdupq_n_u8(n))
+static inline uint64_t buf_cls_mask(const uint8_t *p, int cls)
+{
+    uint8x16_t x, m;
+
+    x = vld1q_u8(p);
+    switch (cls) {
+    case BUF_CLS_NL:
+        m = vceqq_u8(x, vdupq_n_u8('\n'));
+        break;
+    case BUF_CLS_SPACE:
+        m = vorrq_u8(vceqq_u8(x, vdupq_n_u8(' ')), BUF_IN_RANGE(x, '\t', 5));
+        break;
+    case BUF_CLS_HIGH:
+        m = vcgeq_u8(x, vdupq_n_u8(0x80));
+        break;
+    case BUF_CLS_CONT:
+        m = BUF_IN_RANGE(x, 0x80, 64);
+        break;
+    default:
+        m = vorrq_u8(BUF_IN_RANGE(x, '0', 10),
+                BUF_IN_RANGE(vorrq_u8(x, vdupq_n_u8(0x20)), 'a', 26));
+        break;
+    }
+    /* narrow each byte to a nibble */
+    return vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static inline uint64_t buf_eq2_mask(const uint8_t *p, const uint8_t *q, uint8_t a, uint8_t z)
+{
+    uint8x16_t m;
+
+    m = vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8(a)), vceqq_u8(vld1q_u8(q), vdupq_n_u8(z)));
+    return vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+#endif
+#endif /* BUF_SIMD_W */
+
+/* length of the leading run of p[0, n) whose membership in cls is 'in' */
+static inline size_t buf_cls_span(const uint8_t *p, size_t n, int cls, int in)
+{
+    size_t i = 0;
+#ifdef BUF_SIMD_W
+    uint64_t m;
+
+    for (; i + BUF_SIMD_W <= n; i += BUF_SIMD_W) {
+        m = buf_cls_mask(p + i, cls);
+        if (in)
+            m = ~m & BUF_SIMD_FULL;
+        if (m)
+            return i + __builtin_ctzll(m) / BUF_SIMD_BPB;
+    }
+#endif
+    for (; i < n && buf_cls_test(p[i], cls) == in; ++i);
+    return i;
+}
+
+/* length of the trailing run of p[0, n) whose membership in cls is 'in' */
+static inline size_t buf_cls_rspan(const uint8_t *p, size_t n, int cls, int in)
+{
+    size_t i = n;
+#ifdef BUF_SIMD_W
+    uint64_t m;
+
+    for (; i >= BUF_SIMD_W; i -= BUF_SIMD_W) {
+        m = buf_cls_mask(p + i - BUF_SIMD_W, cls);
+        if (in)
+            m = ~m & BUF_SIMD_FULL;
+        if (m)
+            return n - i + (BUF_SIMD_W - 1 - (63 - __builtin_clzll(m)) / BUF_SIMD_BPB);
+    }
+#endif
+    for (; i && buf_cls_test(p[i - 1], cls) == in; --i);
+    return n - i;
+}
+
+/* number of bytes of p[0, n) in cls */
+static inline size_t buf_cls_count(const uint8_t *p, size_t n, int cls)
+{
+    size_t i = 0, cnt = 0;
+#ifdef BUF_SIMD_W
+    for (; i + BUF_SIMD_W <= n; i += BUF_SIMD_W)
+        cnt += __builtin_popcountll(buf_cls_mask(p + i, cls)) / BUF_SIMD_BPB;
+#endif
+    for (; i < n; ++i)
+        cnt += buf_cls_test(p[i], cls);
+    return cnt;
+}
+/*---------------------------------------------------------------------------*/
+#ifdef BUF_USE_LINES
+/* room for the cnt newlines in s[0, n), which buf_lines_insert() then
+ * cannot fail to add */
+static int buf_lines_reserve(Buffer *b, const uint8_t *s, size_t n, size_t *cnt)
+{
+    const uint8_t *p, *e;
+
+    for (*cnt = 0, p = s, e = s + n; (p = memchr(p, '\n', e - p)); ++p, ++*cnt);
+    return buf_offv_reserve(b, &b->lines, *cnt);
+}
+
+static void buf_lines_insert(Buffer *b, const uint8_t *s, size_t n, size_t cnt)
+{
+    const uint8_t *p, *e;
+
+    buf_offv_split(&b->lines, b->gap_start, buf_len(b));
+    for (p = s, e = s + n; cnt && (p = memchr(p, '\n', e - p)); ++p, --cnt)
+        b->lines.v[b->lines.lo++] = b->gap_start + (p - s);
+}
+
+static void buf_lines_delete(Buffer *b, size_t pos, size_t n)
+{
+    buf_offv_split(&b->lines, b->gap_start, buf_len(b));
+    buf_offv_erase(&b->lines, pos, pos + n, buf_len(b));
+}
+
+#ifdef BUF_REINDEX
+static int buf_lines_rebuild(Buffer *b)
+{
+    buf_iter it;
+    buf_slice s;
+    const uint8_t *p, *e;
+    size_t cnt, pos;
+
+    b->lines.lo = 0;
+    b->lines.hi = b->lines.cap;
+    for (cnt = 0, buf_iter_init(&it, b, 0, 0); buf_iter_next(&it, &s);)
+        for (p = s.ptr, e = p + s.len; (p = memchr(p, '\n', e - p)); ++p, ++cnt);
+    if (!buf_offv_reserve(b, &b->lines, cnt))
+        return 0;
+    for (pos = 0, buf_iter_init(&it, b, 0, 0); buf_iter_next(&it, &s); pos += s.len)
+        for (p = s.ptr, e = p + s.len; (p = memchr(p, '\n', e - p)); ++p)
+            b->lines.v[b->lines.lo++] = pos + (p - s.ptr);
+    return 1;
+}
+#endif
+#endif /* BUF_USE_LINES */
+/*---------------------------------------------------------------------------*/
+/* Codepoint checkpoints: utf8.off holds byte offsets about BUF_UTF8_STEP
+ * apart and utf8.cnt, entry for entry, the codepoints before each of them.
+ * Both gap arrays are split at the same index, so an edit only touches
+ * the checkpoints next to it. */
+#ifdef BUF_USE_UTF8
+#define BUF_UTF8_CONT(c) (((c) & 0xc0) == 0x80)
+
+static size_t buf_utf8_count(const uint8_t *p, size_t n)
+{
+    return n - buf_cls_count(p, n, BUF_CLS_CONT);
+}
+
+/* codepoints in [pos, pos+n) */
+static size_t buf_utf8_count_at(const Buffer *b, size_t pos, size_t n)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t cnt;
+
+    if (!n)
+        return 0;
+    for (cnt = 0, buf_iter_init(&it, b, pos, n); buf_iter_next(&it, &s);)
+        cnt += buf_utf8_count(s.ptr, s.len);
+    return cnt;
+}
+
+/* split both arrays at the gap; returns the last checkpoint before it */
+static void buf_utf8_split(Buffer *b, size_t *pos, size_t *cnt)
+{
+    buf_offv *off = &b->utf8.off, *num = &b->utf8.cnt;
+
+    buf_offv_split(off, b->gap_start, buf_len(b));
+    buf_offv_split_at(num, off->lo, b->utf8.total);
+    *pos = off->lo ? off->v[off->lo - 1] : 0;
+    *cnt = num->lo ? num->v[num->lo - 1] : 0;
+}
+
+/* checkpoints from the last one before gap_start up to gap_start + n */
+static size_t buf_utf8_steps(Buffer *b, size_t n, size_t *p0, size_t *c0)
+{
+    buf_utf8_split(b, p0, c0);
+    return b->gap_start + n > *p0 ? (b->gap_start + n - *p0 - 1) / BUF_UTF8_STEP : 0;
+}
+
+/* room for what buf_utf8_insert() of n bytes adds */
+static int buf_utf8_reserve(Buffer *b, size_t n)
+{
+    size_t p0, c0, k;
+
+    k = buf_utf8_steps(b, n, &p0, &c0);
+    return buf_offv_reserve(b, &b->utf8.off, k) && buf_offv_reserve(b, &b->utf8.cnt, k);
+}
+
+/* s[0, n) goes in at gap_start: add checkpoints from the last one
+ * before it up to the end of s; buf_utf8_reserve() made room */
+static void buf_utf8_insert(Buffer *b, const uint8_t *s, size_t n)
+{
+    size_t p0, c0, gap, x, q, k;
+
+    k = buf_utf8_steps(b, n, &p0, &c0);
+    gap = b->gap_start;
+    for (x = p0; k--; x = q) {
+        /* [x, q) is old text up to gap, then s */
+        q = x + BUF_UTF8_STEP;
+        if (x < gap)
+            c0 += buf_utf8_count_at(b, x, (q < gap ? q : gap) - x);
+        if (q > gap)
+            c0 += buf_utf8_count(s + (x > gap ? x - gap : 0), q - (x > gap ? x : gap));
+        b->utf8.off.v[b->utf8.off.lo++] = q;
+        b->utf8.cnt.v[b->utf8.cnt.lo++] = c0;
+    }
+    b->utf8.total += buf_utf8_count(s, n);
+}
+
+static void buf_utf8_delete(Buffer *b, size_t pos, size_t n)
+{
+    size_t p0, c0, lo, hi;
+
+    buf_utf8_split(b, &p0, &c0);
+    lo = b->utf8.off.lo;
+    hi = b->utf8.off.hi;
+    buf_offv_erase(&b->utf8.off, pos, pos + n, buf_len(b));
+    b->utf8.cnt.lo -= lo - b->utf8.off.lo;
+    b->utf8.cnt.hi += b->utf8.off.hi - hi;
+    b->utf8.total -= buf_utf8_count_at(b, pos, n);
+}
+
+#ifdef BUF_REINDEX
+static int buf_utf8_rebuild(Buffer *b)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t k, pos, q, i;
+
+    b->utf8.off.lo = b->utf8.cnt.lo = 0;
+    b->utf8.off.hi = b->utf8.off.cap;
+    b->utf8.cnt.hi = b->utf8.cnt.cap;
+    b->utf8.total = 0;
+    k = buf_len(b) ? (buf_len(b) - 1) / BUF_UTF8_STEP : 0;
+    if (!buf_offv_reserve(b, &b->utf8.off, k) || !buf_offv_reserve(b, &b->utf8.cnt, k))
+        return 0;
+    q = BUF_UTF8_STEP;
+    for (pos = 0, buf_iter_init(&it, b, 0, 0); buf_iter_next(&it, &s); pos += s.len) {
+        for (i = 0; pos + s.len > q && k; q += BUF_UTF8_STEP, --k) {
+            b->utf8.total += buf_utf8_count(s.ptr + i, q - pos - i);
+            i = q - pos;
+            b->utf8.off.v[b->utf8.off.lo++] = q;
+            b->utf8.cnt.v[b->utf8.cnt.lo++] = b->utf8.total;
+        }
+        b->utf8.total += buf_utf8_count(s.ptr + i, s.len - i);
+    }
+    return 1;
+}
+#endif
+#endif /* BUF_USE_UTF8 */
+/*---------------------------------------------------------------------------*/
+/* Markers. The offsets live in a buf_offv ordered by (offset, stickiness),
+ * left-sticky first among equal offsets, so a single split separates the
+ * markers an insert leaves alone from those it pushes along. tag[] moves
+ * in lockstep with off.v[] (both share one block) and slot[] tracks where
+ * each id's entry sits. */
+#ifdef BUF_USE_MARKS
+#define BUF_MARK_FREE ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+/* entry from -> to, holding off */
+static void buf_marks_put(Buffer *b, size_t to, size_t from, size_t off)
+{
+    b->marks.off.v[to] = off;
+    b->marks.tag[to] = b->marks.tag[from];
+    b->marks.slot[b->marks.tag[to] >> 1] = to;
+}
+
+/* the last entry before the gap goes after it */
+static void buf_marks_down(Buffer *b, size_t total)
+{
+    buf_offv *o = &b->marks.off;
+
+    --o->lo;
+    --o->hi;
+    buf_marks_put(b, o->hi, o->lo, total - o->v[o->lo]);
+}
+
+/* the first entry after the gap goes before it */
+static void buf_marks_up(Buffer *b, size_t total)
+{
+    buf_offv *o = &b->marks.off;
+
+    buf_marks_put(b, o->lo, o->hi, total - o->v[o->hi]);
+    ++o->lo;
+    ++o->hi;
+}
+
+static int buf_marks_before(size_t off, size_t tag, size_t pos, int left)
+{
+    return off < pos || (off == pos && left && !(tag & 1));
+}
+
+/* move the gap so that exactly the entries < pos are before it, plus
+ * the left-sticky ones at pos if left */
+static void buf_marks_split(Buffer *b, size_t pos, int left, size_t total)
+{
+    buf_offv *o = &b->marks.off;
+
+    while (o->lo && !buf_marks_before(o->v[o->lo - 1], b->marks.tag[o->lo - 1], pos, left))
+        buf_marks_down(b, total);
+    while (o->hi < o->cap && buf_marks_before(total - o->v[o->hi], b->marks.tag[o->hi], pos, left))
+        buf_marks_up(b, total);
+}
+
+/* entries [from, lo) all land on pos: put the left-sticky ones first */
+static void buf_marks_collapse(Buffer *b, size_t from, size_t pos)
+{
+    buf_offv *o = &b->marks.off;
+    size_t *t = b->marks.tag;
+    size_t i, j, x;
+
+    for (i = from, j = o->lo; ; ++i, --j) {
+        for (; i < j && !(t[i] & 1); ++i);
+        for (; i < j && (t[j - 1] & 1); --j);
+        if (i >= j)
+            break;
+        x = t[i];
+        t[i] = t[j - 1];
+        t[j - 1] = x;
+        b->marks.slot[t[i] >> 1] = i;
+        b->marks.slot[t[j - 1] >> 1] = j - 1;
+    }
+    for (i = from; i < o->lo; ++i)
+        o->v[i] = pos;
+}
+
+static int buf_marks_reserve(Buffer *b)
+{
+    buf_offv *o = &b->marks.off;
+    size_t ncap, tail, i;
+    size_t *p;
+
+    if (o->hi > o->lo)
+        return 1;
+    ncap = o->cap ? o->cap * 2 : 64;
+    if (!(p = buf_mem_realloc(b, NULL, 0, 2 * ncap * sizeof(*p))))
+        return 0;
+    tail = o->cap - o->hi;
+    if (o->cap) {
+        memcpy(p, o->v, o->lo * sizeof(*p));
+        memcpy(p + ncap - tail, o->v + o->hi, tail * sizeof(*p));
+        memcpy(p + ncap, b->marks.tag, o->lo * sizeof(*p));
+        memcpy(p + 2 * ncap - tail, b->marks.tag + o->hi, tail * sizeof(*p));
+        buf_mem_free(b, o->v, 2 * o->cap * sizeof(*p));
+    }
+    o->v = p;
+    b->marks.tag = p + ncap;
+    o->hi = ncap - tail;
+    o->cap = ncap;
+    for (i = o->hi; i < ncap; ++i)
+        b->marks.slot[b->marks.tag[i] >> 1] = i;
+    return 1;
+}
+
+/* a new entry for id; room for it was reserved */
+static void buf_marks_place(Buffer *b, size_t id, size_t pos, int right)
+{
+    buf_offv *o = &b->marks.off;
+
+    buf_marks_split(b, pos, right, buf_len(b));
+    o->v[o->lo] = pos;
+    b->marks.tag[o->lo] = id << 1 | (right != 0);
+    b->marks.slot[id] = o->lo++;
+}
+
+static void buf_marks_remove(Buffer *b, size_t id)
+{
+    buf_offv *o = &b->marks.off;
+    size_t i, total;
+
+    i = b->marks.slot[id];
+    total = buf_len(b);
+    if (i < o->lo) {
+        while (o->lo > i + 1)
+            buf_marks_down(b, total);
+        --o->lo;
+    } else {
+        while (o->hi < i)
+            buf_marks_up(b, total);
+        ++o->hi;
+    }
+}
+
+static int buf_marks_live(const Buffer *b, size_t id)
+{
+    return id < b->marks.nslot && !(b->marks.slot[id] & BUF_MARK_FREE);
+}
+
+/* insert at gap_start */
+static void buf_marks_insert(Buffer *b)
+{
+    buf_marks_split(b, b->gap_start, 1, buf_len(b));
+}
+
+static void buf_marks_delete(Buffer *b, size_t pos, size_t n)
+{
+    buf_offv *o = &b->marks.off;
+    size_t from, total;
+
+    total = buf_len(b);
+    buf_marks_split(b, pos, 0, total);
+    /* the ones at pos + n end up on pos too, keep them in order */
+    from = o->lo;
+    while (o->hi < o->cap && total - o->v[o->hi] <= pos + n)
+        buf_marks_up(b, total);
+    buf_marks_collapse(b, from, pos);
+}
+
+/* the text was replaced: everything goes to 0 */
+static void buf_marks_clear(Buffer *b)
+{
+    buf_offv *o = &b->marks.off;
+
+    while (o->hi < o->cap)
+        buf_marks_up(b, 0);
+    buf_marks_collapse(b, 0, 0);
+}
+#endif /* BUF_USE_MARKS */
+/*---------------------------------------------------------------------------*/
+/* Undo log: one flat, growing arena of records, oldest first.
+ * Each record is a header, its bytes, then its total size so the log can
+ * also be walked backwards. [0, top) is undoable, [top, len) redoable. */
+#ifdef BUF_USE_UNDO
+enum { BUF_UNDO_INS, BUF_UNDO_DEL };
+
+typedef struct {
+    size_t pos;
+    size_t len;
+    int kind;
+} buf_urec;
+
+#define BUF_UREC_SIZE(n) (sizeof(buf_urec) + (n) + sizeof(size_t))
+
+/* read the record ending at end, return where it starts */
+static size_t buf_undo_get(const Buffer *b, size_t end, buf_urec *r)
+{
+    size_t sz;
+
+    memcpy(&sz, b->undo.data + end - sizeof(sz), sizeof(sz));
+    memcpy(r, b->undo.data + end - sz, sizeof(*r));
+    return end - sz;
+}
+
+static int buf_undo_grow(Buffer *b, size_t n)
+{
+    size_t ncap;
+    uint8_t *p;
+
+    if (b->undo.cap - b->undo.len >= n)
+        return 1;
+    ncap = b->undo.cap ? b->undo.cap : 256;
+    while (ncap - b->undo.len < n)
+        ncap *= 2;
+    if (b->undo.limit && ncap > b->undo.limit && b->undo.len + n <= b->undo.limit)
+        ncap = b->undo.limit;
+    p = buf_mem_realloc(b, b->undo.data, b->undo.cap, ncap);
+    if (!p)
+        return 0;
+    b->undo.data = p;
+    b->undo.cap = ncap;
+    return 1;
+}
+
+/* hand back arena memory above the limit, once the records fit in it */
+static void buf_undo_fit(Buffer *b)
+{
+    uint8_t *p;
+
+    if (!b->undo.limit || b->undo.cap <= b->undo.limit || b->undo.len > b->undo.limit)
+        return;
+    /* a failed shrink leaves the old arena, which still works */
+    if ((p = buf_mem_realloc(b, b->undo.data, b->undo.cap, b->undo.limit))) {
+        b->undo.data = p;
+        b->undo.cap = b->undo.limit;
+    }
+}
+
+/* make room for room more bytes under the limit: drop the oldest records,
+ * down to half the limit so this stays amortized */
+static void buf_undo_trim(Buffer *b, size_t room)
+{
+    buf_urec r;
+    size_t cut;
+
+    if (!b->undo.limit || b->undo.len + room <= b->undo.limit)
+        return;
+    for (cut = 0; cut < b->undo.top && b->undo.len - cut + room > b->undo.limit / 2;) {
+        memcpy(&r, b->undo.data + cut, sizeof(r));
+        cut += BUF_UREC_SIZE(r.len);
+    }
+    memmove(b->undo.data, b->undo.data + cut, b->undo.len - cut);
+    b->undo.len -= cut;
+    b->undo.top -= cut;
+    buf_undo_fit(b);
+}
+
+/* Log an edit. s == NULL means copy the bytes from the buffer, which is
+ * how deletions are recorded. Typing forwards, backspacing and deleting
+ * forwards at the same spot extend the previous record instead. */
+static void buf_undo_push(Buffer *b, int kind, size_t pos, const uint8_t *s, size_t n)
+{
+    buf_urec r;
+    size_t rs, off, sz;
+    uint8_t *p;
+
+    if (b->undo.busy || !n)
+        return;
+    b->undo.len = b->undo.top; /* a new edit forgets the redo tail */
+    if (b->undo.limit && BUF_UREC_SIZE(n) > b->undo.limit) {
+        /* could never be kept: don't copy it only to trim it away */
+        b->undo.len = b->undo.top = 0;
+        buf_undo_fit(b);
+        return;
+    }
+    buf_undo_trim(b, BUF_UREC_SIZE(n));
+    if (!buf_undo_grow(b, BUF_UREC_SIZE(n))) {
+        /* history is best effort: rather than failing the edit, forget it */
+        b->undo.len = b->undo.top = 0;
+        return;
+    }
+
+    rs = b->undo.top;
+    r.kind = -1;
+    if (!b->undo.seal && rs)
+        rs = buf_undo_get(b, rs, &r);
+    p = b->undo.data + rs + sizeof(r);
+    if (r.kind == kind && kind == BUF_UNDO_DEL && pos + n == r.pos) {
+        memmove(p + n, p, r.len);
+        off = 0;
+        r.pos = pos;
+        r.len += n;
+    } else if (r.kind == kind && pos == r.pos + (kind == BUF_UNDO_INS ? r.len : 0)) {
+        off = r.len;
+        r.len += n;
+    } else {
+        rs = b->undo.top;
+        p = b->undo.data + rs + sizeof(r);
+        off = 0;
+        r.kind = kind;
+        r.pos = pos;
+        r.len = n;
+    }
+
+    if (s)
+        memcpy(p + off, s, n);
+    else
+        buf_read(b, pos, p + off, n);
+    sz = BUF_UREC_SIZE(r.len);
+    memcpy(b->undo.data + rs, &r, sizeof(r));
+    memcpy(b->undo.data + rs + sz - sizeof(sz), &sz, sizeof(sz));
+    b->undo.top = b->undo.len = rs + sz;
+    b->undo.seal = 0;
+}
+#endif /* BUF_USE_UNDO */
+/*---------------------------------------------------------------------------*/
+/* Damage: c covers every change so far; fold in one more, made to the
+ * current text, that replaced del bytes at pos with ins. The union spans
+ * both in the current text; past its end the old text is shifted by
+ * inserted - removed, which gives its end in the old one. */
+#if defined(BUF_USE_DAMAGE) || defined(BUF_USE_OBSERVE)
+static void buf_change_add(buf_change *c, int *dirty, size_t pos, size_t del, size_t ins)
+{
+    size_t lo, hi;
+
+    if (!*dirty) {
+        c->start = pos;
+        c->removed = del;
+        c->inserted = ins;
+        *dirty = 1;
+        return;
+    }
+    lo = pos < c->start ? pos : c->start;
+    hi = c->start + c->inserted;
+    if (pos + del > hi)
+        hi = pos + del;
+    c->removed = hi + c->removed - c->inserted - lo;
+    c->inserted = hi - del + ins - lo;
+    c->start = lo;
+}
+#endif
+
+#ifdef BUF_USE_OBSERVE
+/* a change is only tracked while someone listens */
+static void buf_obs_add(Buffer *b, size_t pos, size_t del, size_t ins)
+{
+    if (b->obs.n)
+        buf_change_add(&b->obs.pending, &b->obs.dirty, pos, del, ins);
+}
+
+/* deliver the pending change, unless a batch holds it back */
+static void buf_obs_flush(Buffer *b)
+{
+    buf_change c;
+    size_t i;
+
+    if (!b->obs.dirty || b->obs.batch)
+        return;
+    c = b->obs.pending;
+    b->obs.dirty = 0;
+    for (i = 0; i < b->obs.n; ++i)
+        b->obs.v[i].fn(b->obs.v[i].ctx, b, &c);
+}
+#endif /* BUF_USE_OBSERVE */
+/*---------------------------------------------------------------------------*/
+/* Journal. The log starts with a header naming the base file it applies
+ * to, by length and CRC-32 of its text:
+ *   "GBFJ" crc32(base) u64 len(base) crc32(header)
+ * then holds one record per edit, little-endian and varint-coded:
+ *   'i' pos len bytes crc32  or  'd' pos len crc32
+ * Records go to buf first. [0, mark) belongs to finished edits; a record
+ * past mark is dropped if its edit fails, see buf_did_edit(). */
+#ifdef BUF_USE_JOURNAL
+#define BUF_JHDR 20
+
+enum { BUF_JOURNAL_INS = 'i', BUF_JOURNAL_DEL = 'd' };
+
+struct buf_journal {
+    int fd;
+    int err;
+    char *path;
+    buf_journal_conf conf;
+    uint8_t *buf;
+    size_t len;
+    size_t mark;
+    size_t cap;
+    uint64_t size; /* bytes in the log file */
+    uint64_t last; /* ms of the last commit */
+};
+
+static const uint32_t buf_crc_tab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/* CRC-32 (zlib's), a nibble at a time */
+static uint32_t buf_crc32(uint32_t crc, const uint8_t *p, size_t n)
+{
+    crc = ~crc;
+    while (n--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ buf_crc_tab[crc & 15];
+        crc = (crc >> 4) ^ buf_crc_tab[crc & 15];
+    }
+    return ~crc;
+}
+
+static uint32_t buf_crc_text(const Buffer *b)
+{
+    buf_iter it;
+    buf_slice s;
+    uint32_t crc;
+
+    crc = 0;
+    for (buf_iter_init(&it, b, 0, 0); buf_iter_next(&it, &s);)
+        crc = buf_crc32(crc, s.ptr, s.len);
+    return crc;
+}
+
+static void buf_put_le(uint8_t *p, uint64_t v, int n)
+{
+    while (n--) {
+        *p++ = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t buf_get_le(const uint8_t *p, int n)
+{
+    uint64_t v;
+
+    for (v = 0; n--;)
+        v = v << 8 | p[n];
+    return v;
+}
+
+static size_t buf_put_varint(uint8_t *p, uint64_t v)
+{
+    size_t i;
+
+    for (i = 0; v >= 0x80; v >>= 7)
+        p[i++] = (uint8_t)(v | 0x80);
+    p[i++] = (uint8_t)v;
+    return i;
+}
+
+/* bytes read, 0 if p[0, n) holds no complete varint */
+static size_t buf_get_varint(const uint8_t *p, size_t n, uint64_t *v)
+{
+    size_t i;
+
+    for (*v = 0, i = 0; i < n && i < 10; ++i) {
+        *v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+static void buf_journal_header(uint8_t h[BUF_JHDR], const Buffer *b)
+{
+    memcpy(h, "GBFJ", 4);
+    buf_put_le(h + 4, buf_crc_text(b), 4);
+    buf_put_le(h + 8, buf_len(b), 8);
+    buf_put_le(h + 16, buf_crc32(0, h, 16), 4);
+}
+
+static uint64_t buf_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int buf_journal_log(Buffer *b, int kind, size_t pos, const uint8_t *s, size_t n)
+{
+    struct buf_journal *j;
+    size_t need, ncap, at;
+    uint8_t *p;
+
+    j = b->journal;
+    j->len = j->mark;
+    need = 1 + 10 + 10 + (s ? n : 0) + 4;
+    if (j->len + need > j->cap) {
+        for (ncap = j->cap ? j->cap : 256; ncap < j->len + need; ncap *= 2);
+        if (!(p = (uint8_t *)buf_mem_realloc(b, j->buf, j->cap, ncap)))
+            return 0;
+        j->buf = p;
+        j->cap = ncap;
+    }
+    at = j->len;
+    p = j->buf + at;
+    *p++ = (uint8_t)kind;
+    p += buf_put_varint(p, pos);
+    p += buf_put_varint(p, n);
+    if (s) {
+        memcpy(p, s, n);
+        p += n;
+    }
+    buf_put_le(p, buf_crc32(0, j->buf + at, p - (j->buf + at)), 4);
+    j->len = p + 4 - j->buf;
+    return 1;
+}
+
+/* write out [0, mark), then fdatasync() if sync */
+static int buf_journal_commit(struct buf_journal *j, int sync)
+{
+    size_t off;
+    ssize_t w;
+
+    for (off = 0; off < j->mark; off += w) {
+        w = pwrite(j->fd, j->buf + off, j->mark - off, j->size + off);
+        if (w < 0 && errno == EINTR)
+            w = 0;
+        else if (w <= 0)
+            return !(j->err = 1);
+    }
+    j->size += j->mark;
+    if (j->len > j->mark)
+        memmove(j->buf, j->buf + j->mark, j->len - j->mark);
+    j->len -= j->mark;
+    j->mark = 0;
+    if (sync) {
+        if (fdatasync(j->fd) < 0)
+            return !(j->err = 1);
+        j->last = buf_ms();
+    }
+    return !j->err;
+}
+
+/* decode the record at p, 0 if it is torn, corrupt or does not fit b */
+static size_t buf_journal_record(const Buffer *b, const uint8_t *p, size_t n,
+        int *kind, uint64_t *pos, uint64_t *len)
+{
+    size_t i, k;
+
+    if (n < 1 || (p[0] != BUF_JOURNAL_INS && p[0] != BUF_JOURNAL_DEL))
+        return 0;
+    *kind = p[0];
+    i = 1;
+    if (!(k = buf_get_varint(p + i, n - i, pos)))
+        return 0;
+    i += k;
+    if (!(k = buf_get_varint(p + i, n - i, len)))
+        return 0;
+    i += k;
+    if (*pos > buf_len(b) || (*kind == BUF_JOURNAL_DEL && *len > buf_len(b) - *pos))
+        return 0;
+    if (*kind == BUF_JOURNAL_INS) {
+        if (*len > n - i)
+            return 0;
+        i += *len;
+    }
+    if (n - i < 4 || buf_get_le(p + i, 4) != buf_crc32(0, p, i))
+        return 0;
+    return i + 4;
+}
+
+/* the log up to where it stops making sense; 0 if it is not for b */
+static size_t buf_journal_apply(Buffer *b, const uint8_t *p, size_t n)
+{
+    uint8_t h[BUF_JHDR];
+    uint64_t pos, len;
+    size_t off, k;
+    int kind, ok;
+
+    buf_journal_header(h, b);
+    if (n < BUF_JHDR || memcmp(p, h, BUF_JHDR))
+        return 0;
+    for (off = BUF_JHDR; (k = buf_journal_record(b, p + off, n - off, &kind, &pos, &len)); off += k) {
+        if (kind == BUF_JOURNAL_INS)
+            ok = !len || buf_insert(b, pos, p + off + k - 4 - len, len);
+        else
+            ok = !len || (buf_cursor_set(b, pos) && buf_delete(b, len));
+        if (!ok)
+            return (size_t)-1;
+    }
+    return off;
+}
+
+static int buf_sync_dir(const char *path)
+{
+    const char *slash;
+    char *dir;
+    size_t n;
+    int fd, ok;
+
+    slash = strrchr(path, '/');
+    n = slash ? (size_t)(slash - path) + 1 : 1;
+    if (!(dir = (char *)malloc(n + 1)))
+        return 0;
+    memcpy(dir, slash ? path : ".", n);
+    dir[n] = '\0';
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return 0;
+    ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+
+/* after an edit: its record is final; commit when due, compact when the
+ * log got too long */
+static void buf_journal_done(Buffer *b)
+{
+    struct buf_journal *j;
+
+    j = b->journal;
+    j->mark = j->len;
+    if (!j->conf.sync_ms || buf_ms() - j->last >= j->conf.sync_ms)
+        buf_journal_commit(j, 1);
+    else if (j->len >= BUF_JOURNAL_BUF)
+        buf_journal_commit(j, 0);
+    if (j->conf.compact && j->size > BUF_JOURNAL_BUF
+            && (j->size - BUF_JHDR) / j->conf.compact > buf_len(b) / 100)
+        buf_journal_checkpoint(b);
+}
+
+/* buf_reset() */
+static void buf_journal_reset(Buffer *b)
+{
+    if (!buf_journal_log(b, BUF_JOURNAL_DEL, 0, NULL, buf_len(b)))
+        b->journal->err = 1;
+}
+#endif /* BUF_USE_JOURNAL */
+/*---------------------------------------------------------------------------*/
+/* Edit hooks: every change to the text goes through these, while the old
+ * contents are still in place, so the optional indexes can follow.
+ * Inserts always happen at gap_start; buf_will_insert() may fail, but
+ * only before it has touched any index. */
+static int buf_will_insert(Buffer *b, const uint8_t *s, size_t n)
+{
+#ifdef BUF_USE_LINES
+    size_t nl;
+
+    if (!buf_lines_reserve(b, s, n, &nl))
+        return 0;
+#endif
+#ifdef BUF_USE_UTF8
+    if (!buf_utf8_reserve(b, n))
+        return 0;
+#endif
+#ifdef BUF_USE_JOURNAL
+    if (b->journal && n && !buf_journal_log(b, BUF_JOURNAL_INS, b->gap_start, s, n))
+        return 0;
+#endif
+#ifdef BUF_USE_LINES
+    buf_lines_insert(b, s, n, nl);
+#endif
+#ifdef BUF_USE_UTF8
+    buf_utf8_insert(b, s, n);
+#endif
+#ifdef BUF_USE_MARKS
+    buf_marks_insert(b);
+#endif
+#ifdef BUF_USE_UNDO
+    buf_undo_push(b, BUF_UNDO_INS, b->gap_start, s, n);
+#endif
+#ifdef BUF_USE_DAMAGE
+    buf_change_add(&b->damage.range, &b->damage.dirty, b->gap_start, 0, n);
+#endif
+#ifdef BUF_USE_OBSERVE
+    buf_obs_add(b, b->gap_start, 0, n);
+#endif
+    (void)b; (void)s; (void)n;
+    return 1;
+}
+
+#ifdef BUF_REINDEX
+/* rebuild the indexes after the text was replaced wholesale */
+static int buf_reindex(Buffer *b)
+{
+#ifdef BUF_USE_JOURNAL
+    if (b->journal)
+        b->journal->err = 1;
+#endif
+#ifdef BUF_USE_UNDO
+    b->undo.len = b->undo.top = 0;
+#endif
+#ifdef BUF_USE_DAMAGE
+    b->damage.range.start = 0;
+    b->damage.range.removed = b->damage.base;
+    b->damage.range.inserted = buf_len(b);
+    b->damage.dirty = 1;
+#endif
+#ifdef BUF_USE_LINES
+    if (!buf_lines_rebuild(b))
+        return 0;
+#endif
+#ifdef BUF_USE_UTF8
+    if (!buf_utf8_rebuild(b))
+        return 0;
+#endif
+#ifdef BUF_USE_MARKS
+    buf_marks_clear(b);
+#endif
+    (void)b;
+    return 1;
+}
+#endif
+
+/* [pos, pos+n) is about to go; it touches gap_start on one side */
+static void buf_will_delete(Buffer *b, size_t pos, size_t n)
+{
+#ifdef BUF_USE_JOURNAL
+    if (b->journal && !buf_journal_log(b, BUF_JOURNAL_DEL, pos, NULL, n))
+        b->journal->err = 1;
+#endif
+#ifdef BUF_USE_LINES
+    buf_lines_delete(b, pos, n);
+#endif
+#ifdef BUF_USE_UTF8
+    buf_utf8_delete(b, pos, n);
+#endif
+#ifdef BUF_USE_MARKS
+    buf_marks_delete(b, pos, n);
+#endif
+#ifdef BUF_USE_UNDO
+    buf_undo_push(b, BUF_UNDO_DEL, pos, NULL, n);
+#endif
+#ifdef BUF_USE_DAMAGE
+    buf_change_add(&b->damage.range, &b->damage.dirty, pos, n, 0);
+#endif
+#ifdef BUF_USE_OBSERVE
+    buf_obs_add(b, pos, n, 0);
+#endif
+    (void)b; (void)pos; (void)n;
+}
+
+/* the edit is done */
+static void buf_did_edit(Buffer *b)
+{
+#ifdef BUF_USE_SLAB
+    b->touched = 1;
+#endif
+#ifdef BUF_USE_JOURNAL
+    if (b->journal)
+        buf_journal_done(b);
+#endif
+#ifdef BUF_USE_FREEZE
+    buf_lru_touch(b);
+#endif
+#ifdef BUF_USE_OBSERVE
+    buf_obs_flush(b);
+#endif
+    (void)b;
+}
+
+/* s[0, n) goes in at the gap, once buf_will_insert() has seen it */
+static void buf_put(Buffer *b, const uint8_t *s, size_t n)
+{
+#ifdef BUF_USE_CHUNKS
+    buf_chunk_insert(b, b->gap_start, s, n);
+    b->gap_end += n;
+#else
+    memcpy(b->data + b->gap_start, s, n);
+#endif
+    b->gap_start += n;
+}
+
+/* [pos, pos+n), next to the gap, goes once buf_will_delete() has seen it */
+static void buf_cut(Buffer *b, size_t pos, size_t n)
+{
+#ifdef BUF_USE_CHUNKS
+    buf_chunk_erase(b, pos, n);
+    b->gap_start = b->gap_end = pos;
+#else
+    if (pos == b->gap_start)
+        b->gap_end += n;
+    else
+        b->gap_start -= n;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+size_t buf_len(const Buffer *b)
+{
+#ifdef BUF_USE_FREEZE
+    if (b && b->frz.z)
+        return b->frz.len;
+#endif
+    return b ? b->capacity - (b->gap_end - b->gap_start) : 0;
+}
+
+size_t buf_cursor(const Buffer *b)
+{
+    return b ? b->cursor : 0;
+}
+
+int buf_cursor_set(Buffer *b, size_t pos)
+{
+    buf_assert(b);
+    if (pos > buf_len(b))
+        return 0;
+    b->cursor = pos;
+    return 1;
+}
+
+int buf_cursor_move(Buffer *b, ptrdiff_t delta)
+{
+    ptrdiff_t pos;
+    buf_assert(b);
+    pos = (ptrdiff_t)b->cursor + delta;
+    if (pos < 0 || (size_t)pos > buf_len(b))
+        return 0;
+    return buf_cursor_set(b, pos);
+}
+
+/* add a byte */
+int buf_ccat(Buffer *b, uint8_t c)
+{
+    buf_assert(b);
+    if (!b || !buf_move_gap(b, b->cursor) || !buf_reserve(b, 1)
+            || !buf_will_insert(b, &c, 1))
+        return 0;
+    buf_put(b, &c, 1);
+    b->cursor = b->gap_start;
+    buf_did_edit(b);
+    buf_assert(b);
+    return 1;
+}
+/* n == 0, treat as cstr */
+int buf_cat(Buffer *b, const uint8_t *s, size_t n)
+{
+    buf_assert(b);
+    if (!b || !s)
+        return 0;
+    n = n ? n : strlen((const char *)s);
+    if (!buf_move_gap(b, b->cursor) || !buf_reserve(b, n) || !buf_will_insert(b, s, n))
+        return 0;
+    buf_put(b, s, n);
+    b->cursor = b->gap_start;
+    buf_did_edit(b);
+    buf_assert(b);
+    return 1;
+}
+
+int buf_insert(Buffer *b, size_t pos, const uint8_t *s, size_t n)
+{
+    buf_assert(b);
+    if (!b || !s)
+        return 0;
+    if (!buf_cursor_set(b, pos))
+        return 0;
+    return buf_cat(b, s, n);
+}
+
+/* give memory back once the text fills less than the shrink policy's share */
+static void buf_shrink(Buffer *b)
+{
+    const buf_growth *g;
+    size_t init;
+
+    g = buf_growth_of(b);
+    init = buf_growth_init(g);
+    if (g->shrink && !(b->flags & BUF_F_NOSHRINK) && b->capacity > init
+            && buf_len(b) < b->capacity / 100 * g->shrink)
+        buf_compact(b, buf_len(b) > init ? buf_len(b) : init);
+}
+
+int buf_delete(Buffer *b, ptrdiff_t delta)
+{
+    size_t pos, n;
+
+    buf_assert(b);
+    if (!b || ! delta)
+        return 0;
+    if (delta > 0 ? (size_t)delta > buf_len(b) - b->cursor : (size_t)-delta > b->cursor)
+        return 0;
+    if (!buf_move_gap(b, b->cursor))
+        return 0;
+    n = delta > 0 ? (size_t)delta : (size_t)-delta;
+    pos = delta > 0 ? b->gap_start : b->gap_start - n;
+    buf_will_delete(b, pos, n);
+    buf_cut(b, pos, n);
+    b->cursor = b->gap_start;
+    buf_shrink(b);
+    buf_did_edit(b);
+    buf_assert(b);
+    return 1;
+}
+
+typedef struct {
+    size_t pos;
+    size_t i;
+} buf_edit_ord;
+
+static int buf_edit_cmp(const void *x, const void *y)
+{
+    const buf_edit_ord *a = x, *b = y;
+
+    if (a->pos != b->pos)
+        return a->pos < b->pos ? -1 : 1;
+    return a->i < b->i ? -1 : a->i > b->i;
+}
+
+int buf_apply_edits(Buffer *b, const buf_edit *edits, size_t n)
+{
+    buf_edit_ord *ord;
+    size_t i, end;
+    ptrdiff_t shift, peak;
+    const buf_edit *e;
+    int ok;
+
+    buf_assert(b);
+    if (!b || (n && !edits))
+        return 0;
+    if (!n)
+        return 1;
+
+    ord = buf_mem_realloc(b, NULL, 0, n * sizeof(*ord));
+    if (!ord)
+        return 0;
+#ifdef BUF_USE_OBSERVE
+    buf_batch_begin(b);
+#endif
+    for (i = 0; i < n; ++i) {
+        ord[i].pos = edits[i].pos;
+        ord[i].i = i;
+    }
+    for (i = 1; i < n && edits[i - 1].pos <= edits[i].pos; ++i);
+    if (i < n)
+        qsort(ord, n, sizeof(*ord), buf_edit_cmp);
+
+    ok = 0;
+    shift = peak = 0;
+    for (end = 0, i = 0; i < n; ++i) {
+        e = &edits[ord[i].i];
+        if (e->pos < end || e->pos > buf_len(b) || e->del > buf_len(b) - e->pos
+                || (e->len && !e->s))
+            goto out;
+        end = e->pos + e->del;
+        shift += (ptrdiff_t)e->len - (ptrdiff_t)e->del;
+        if (shift > peak)
+            peak = shift;
+    }
+    if (!buf_reserve(b, peak))
+        goto out;
+
+    /* a delete early in the sweep must not compact away the room reserved
+     * for the inserts after it */
+    b->flags |= BUF_F_NOSHRINK;
+    for (shift = 0, i = 0; i < n; ++i) {
+        e = &edits[ord[i].i];
+        if (!buf_cursor_set(b, e->pos + shift))
+            goto out;
+        if (e->del && !buf_delete(b, e->del))
+            goto out;
+        if (e->len && !buf_cat(b, e->s, e->len))
+            goto out;
+        shift += (ptrdiff_t)e->len - (ptrdiff_t)e->del;
+    }
+    ok = 1;
+out:
+    if (b->flags & BUF_F_NOSHRINK) {
+        b->flags &= ~BUF_F_NOSHRINK;
+        buf_shrink(b);
+    }
+#ifdef BUF_USE_OBSERVE
+    buf_batch_end(b);
+#endif
+    buf_mem_free(b, ord, n * sizeof(*ord));
+    return ok;
+}
+/*---------------------------------------------------------------------------*/
+
+/* The contiguous stretch of storage holding byte pos (< buf_len(b)),
+ * whole, in out; returns the text offset it starts at. Every reader goes
+ * through this (or buf_iter), so none depends on how the text is laid out. */
+static size_t buf_run(const Buffer *b, size_t pos, buf_slice *out)
+{
+#ifdef BUF_USE_CHUNKS
+    size_t i, start;
+
+    i = buf_chunk_find(b, pos);
+    start = buf_chunk_start(b, i);
+    out->ptr = buf_chunk_ptr(b, i);
+    out->len = buf_chunk_end(b, i) - start;
+    return start;
+#else
+    if (pos < b->gap_start) {
+        out->ptr = b->data;
+        out->len = b->gap_start;
+        return 0;
+    }
+    out->ptr = b->data + b->gap_end;
+    out->len = b->capacity - b->gap_end;
+    return b->gap_start;
+#endif
+}
+
+size_t buf_read(const Buffer *b, size_t pos, uint8_t *dst, size_t n)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t len;
+
+    buf_assert(b);
+    if (!b || !dst || !n)
+        return 0;
+
+    len = 0;
+    for (buf_iter_init(&it, b, pos, n); buf_iter_next(&it, &s); len += s.len)
+        memcpy(dst + len, s.ptr, s.len);
+    return len;
+}
+
+void buf_iter_init(buf_iter *it, const Buffer *b, size_t pos, size_t n)
+{
+    size_t buflen;
+
+    buf_assert(b);
+    buflen = BUF_THAW(b) ? buf_len(b) : 0;
+    it->b = b;
+    it->pos = pos < buflen ? pos : buflen;
+    it->end = (!n || n > buflen - it->pos) ? buflen : it->pos + n;
+}
+
+int buf_iter_next(buf_iter *it, buf_slice *out)
+{
+    buf_slice r;
+    size_t start;
+
+    if (!out || it->pos >= it->end)
+        return 0;
+    start = buf_run(it->b, it->pos, &r);
+    out->ptr = r.ptr + (it->pos - start);
+    out->len = (it->end < start + r.len ? it->end : start + r.len) - it->pos;
+    it->pos += out->len;
+    return 1;
+}
+
+/* n == 0 add [pos, buflen]  */
+size_t buf_view(const Buffer *b, size_t pos, size_t n, buf_slice out[2])
+{
+    buf_slice r;
+    size_t buflen, start;
+
+    buf_assert(b);
+    buflen = buf_len(b);
+    if (!b || !out || pos >= buflen || !BUF_THAW(b))
+        return 0;
+
+    if (pos + n > buflen || !n)
+        n = buflen - pos;
+
+
+    memset(out, 0, sizeof(*out)*2);
+    start = buf_run(b, pos, &r);
+    out->ptr = r.ptr + (pos - start);
+    out->len = start + r.len - pos < n ? start + r.len - pos : n;
+    if (out->len < n) {
+        buf_run(b, pos + out->len, &r);
+        out[1].ptr = r.ptr;
+        out[1].len = n - out->len;
+#ifdef BUF_USE_CHUNKS
+        if (out[1].len > r.len) {
+            memset(out, 0, sizeof(*out)*2);
+            if (!(out->ptr = buf_chunk_gather(b, pos, n)))
+                return 0;
+            out->len = n;
+        }
+#endif
+    }
+    return n;
+}
+
+uint8_t *buf_flatten(const Buffer *b)
+{
+    uint8_t *buf;
+    size_t buflen;
+
+    buf_assert(b);
+    if (!b || !BUF_THAW(b))
+        return NULL;
+
+#ifdef BUF_USE_CHUNKS
+    buflen = buf_len(b);
+    buf = malloc(buflen + 1);
+    if (!buf)
+        return NULL;
+    buf_read(b, 0, buf, buflen);
+#else
+    size_t h, t;
+#ifdef GAP_DEBUG
+    buflen = b->capacity;
+#else
+    buflen = buf_len(b);
+#endif
+    buf = malloc(buflen + 1);
+    if (!buf)
+        return NULL;
+    h = b->gap_start;
+    t = b->capacity - b->gap_end;
+
+    memcpy(buf, b->data, h);
+#ifdef GAP_DEBUG
+    size_t gap = buf_gap_len(b);
+    memset(buf + h, '_', gap);
+    memcpy(buf + h + gap, b->data + b->gap_end, t);
+#else
+    memcpy(buf + h, b->data + b->gap_end, t);
+#endif
+#endif /* BUF_USE_CHUNKS */
+    buf[buflen] = '\0';
+
+    buf_assert(b);
+    return buf;
+}
+#ifdef BUF_USE_SNAPSHOT
+const Buffer *buf_snapshot(Buffer *b)
+{
+    struct buf_share *sh;
+    buf_snap *s;
+
+    buf_assert(b);
+    if (!b || !BUF_THAW(b)
+            || ((b->flags & BUF_F_BORROWED) && !buf_relocate(b, b->capacity)))
+        return NULL;
+    if (!(s = (buf_snap *)buf_mem_realloc(b, NULL, 0, sizeof(*s))))
+        return NULL;
+    if (!(sh = b->snap.share)) {
+        if (!(sh = (struct buf_share *)buf_mem_realloc(b, NULL, 0, sizeof(*sh)))) {
+            buf_mem_free(b, s, sizeof(*s));
+            return NULL;
+        }
+        sh->refs = 1;
+        sh->data = b->data;
+        sh->capacity = b->capacity;
+        sh->flags = b->flags;
+        b->snap.share = sh;
+        b->snap.lo = b->gap_start;
+        b->snap.hi = b->gap_end;
+    }
+    __atomic_add_fetch(&sh->refs, 1, __ATOMIC_RELAXED);
+    if (b->snap.lo < b->gap_start)
+        b->snap.lo = b->gap_start;
+    if (b->snap.hi > b->gap_end)
+        b->snap.hi = b->gap_end;
+
+    memset(s, 0, sizeof(*s));
+    s->b.data = b->data;
+    s->b.gap_start = b->gap_start;
+    s->b.gap_end = b->gap_end;
+    s->b.capacity = b->capacity;
+    s->b.cursor = b->cursor;
+    s->b.alloc = b->alloc;
+    s->share = sh;
+    return &s->b;
+}
+
+void buf_snapshot_release(const Buffer *snap)
+{
+    buf_snap *s;
+
+    if (!snap)
+        return;
+    s = (buf_snap *)(void *)snap;
+    buf_share_drop(&s->b, s->share);
+    buf_mem_free(&s->b, s, sizeof(*s));
+}
+#endif /* BUF_USE_SNAPSHOT */
+/*---------------------------------------------------------------------------*/
+/* Search. Each side of the gap is scanned as one block: vectors compare
+ * the first and last byte of the pattern at W starting points at once and
+ * only the hits are memcmp()ed; without SIMD, and for the tail of a
+ * block, Horspool shifts take over. Matches straddling the gap, at most
+ * n - 1 of them, are checked one by one. */
+void buf_pattern_init(buf_pattern *p, const uint8_t *s, size_t n)
+{
+    size_t i;
+
+    if (!p)
+        return;
+    p->s = s;
+    p->n = s ? n : 0;
+    for (i = 0; i < 256; ++i)
+        p->skip[i] = p->rskip[i] = p->n;
+    for (i = 0; i + 1 < p->n; ++i)
+        p->skip[s[i]] = p->n - 1 - i;
+    for (i = p->n; i-- > 1;)
+        p->rskip[s[i]] = i;
+}
+
+/* first match in h[0, len) */
+static size_t buf_scan(const uint8_t *h, size_t len, const buf_pattern *p)
+{
+    size_t i, last;
+
+    if (len < p->n)
+        return BUF_NPOS;
+    i = 0;
+    last = p->n - 1;
+#ifdef BUF_SIMD_W
+    uint64_t m;
+    size_t k;
+
+    for (; i + last + BUF_SIMD_W <= len; i += BUF_SIMD_W) {
+        m = buf_eq2_mask(h + i, h + i + last, p->s[0], p->s[last]);
+        for (; m; m &= ~(((1ull << BUF_SIMD_BPB) - 1) << k * BUF_SIMD_BPB)) {
+            k = __builtin_ctzll(m) / BUF_SIMD_BPB;
+            if (!memcmp(h + i + k, p->s, last))
+                return i + k;
+        }
+    }
+#endif
+    for (; i + last < len; i += p->skip[h[i + last]])
+        if (h[i + last] == p->s[last] && !memcmp(h + i, p->s, last))
+            return i;
+    return BUF_NPOS;
+}
+
+/* last match in h[0, len) */
+static size_t buf_rscan(const uint8_t *h, size_t len, const buf_pattern *p)
+{
+    size_t i, last;
+
+    if (len < p->n)
+        return BUF_NPOS;
+    i = len - p->n + 1; /* starting points left to try: [0, i) */
+    last = p->n - 1;
+#ifdef BUF_SIMD_W
+    uint64_t m;
+    size_t k;
+
+    for (; i >= BUF_SIMD_W; i -= BUF_SIMD_W) {
+        m = buf_eq2_mask(h + i - BUF_SIMD_W, h + i - BUF_SIMD_W + last, p->s[0], p->s[last]);
+        for (; m; m &= ~(((1ull << BUF_SIMD_BPB) - 1) << k * BUF_SIMD_BPB)) {
+            k = (63 - __builtin_clzll(m)) / BUF_SIMD_BPB;
+            if (!memcmp(h + i - BUF_SIMD_W + k + 1, p->s + 1, last))
+                return i - BUF_SIMD_W + k;
+        }
+    }
+#endif
+    while (i) {
+        --i;
+        if (h[i] == p->s[0] && !memcmp(h + i + 1, p->s + 1, last))
+            return i;
+        if (p->rskip[h[i]] > i)
+            break;
+        i -= p->rskip[h[i]] - 1;
+    }
+    return BUF_NPOS;
+}
+
+/* does the match at pos, which may span runs of storage, hold */
+static int buf_match_at(const Buffer *b, size_t pos, const buf_pattern *p)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t k;
+
+    k = 0;
+    for (buf_iter_init(&it, b, pos, p->n); buf_iter_next(&it, &s); k += s.len)
+        if (memcmp(s.ptr, p->s + k, s.len))
+            return 0;
+    return 1;
+}
+
+size_t buf_find(const Buffer *b, const buf_pattern *p, size_t from)
+{
+    buf_slice s;
+    size_t len, pos, start, end, k, r;
+
+    buf_assert(b);
+    len = buf_len(b);
+    if (!b || !p || from > len || p->n > len - from)
+        return BUF_NPOS;
+    if (!p->n)
+        return from;
+    if (!BUF_THAW(b))
+        return BUF_NPOS;
+    for (pos = from; pos + p->n <= len; pos = end) {
+        start = buf_run(b, pos, &s);
+        end = start + s.len;
+        if ((r = buf_scan(s.ptr + (pos - start), end - pos, p)) != BUF_NPOS)
+            return pos + r;
+        /* starts that run past this stretch: [max(pos, end - n + 1), end) */
+        k = end - pos >= p->n ? end - p->n + 1 : pos;
+        for (; k < end && k + p->n <= len; ++k)
+            if (buf_match_at(b, k, p))
+                return k;
+    }
+    return BUF_NPOS;
+}
+
+size_t buf_rfind(const Buffer *b, const buf_pattern *p, size_t end)
+{
+    buf_slice s;
+    size_t pos, start, k, r;
+
+    buf_assert(b);
+    if (!b || !p)
+        return BUF_NPOS;
+    end = end < buf_len(b) ? end : buf_len(b);
+    if (p->n > end)
+        return BUF_NPOS;
+    if (!p->n)
+        return end;
+    if (!BUF_THAW(b))
+        return BUF_NPOS;
+    for (pos = end; pos >= p->n; pos = start) {
+        start = buf_run(b, pos - 1, &s);
+        if ((r = buf_rscan(s.ptr, pos - start, p)) != BUF_NPOS)
+            return start + r;
+        /* starts that run into this stretch, right to left:
+         * (start - n, min(start, end - n + 1)) */
+        k = end - p->n + 1 < start ? end - p->n + 1 : start;
+        for (; k-- > 0 && k + p->n > start;)
+            if (buf_match_at(b, k, p))
+                return k;
+    }
+    return BUF_NPOS;
+}
+
+/* Scan from pos over the bytes whose membership in cls is 'in', walking
+ * each run of storage in turn. Returns the first position that stops the scan. */
+static size_t buf_skip_forward(const Buffer *b, size_t pos, int cls, int in)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t k;
+
+    for (buf_iter_init(&it, b, pos, 0); buf_iter_next(&it, &s);) {
+        k = buf_cls_span(s.ptr, s.len, cls, in);
+        pos += k;
+        if (k < s.len)
+            break;
+    }
+    return pos;
+}
+
+static size_t buf_skip_backward(const Buffer *b, size_t pos, int cls, int in)
+{
+    buf_slice s;
+    size_t start, k;
+
+    if (!pos || !BUF_THAW(b) || pos > buf_len(b))
+        return pos;
+    while (pos) {
+        start = buf_run(b, pos - 1, &s);
+        k = buf_cls_rspan(s.ptr, pos - start, cls, in);
+        pos -= k;
+        if (pos > start)
+            break;
+    }
+    return pos;
+}
+
+/* [start, end) into out, see buf_line_iter */
+static void buf_line_view(const Buffer *b, size_t start, size_t end, buf_slice out[2])
+{
+    if (!out)
+        return;
+    memset(out, 0, sizeof(*out) * 2);
+    if (end > start)
+        buf_view(b, start, end - start, out);
+}
+
+void buf_line_iter_init(buf_line_iter *it, const Buffer *b, size_t pos)
+{
+    buf_assert(b);
+    if (!it)
+        return;
+    pos = pos < buf_len(b) ? pos : buf_len(b);
+    it->b = b;
+    it->next = buf_skip_backward(b, pos, BUF_CLS_NL, 0);
+    it->prev = buf_skip_forward(b, pos, BUF_CLS_NL, 0);
+}
+
+size_t buf_line_next(buf_line_iter *it, buf_slice out[2])
+{
+    size_t start, end;
+
+    if (!it || (start = it->next) == BUF_NPOS)
+        return BUF_NPOS;
+    end = buf_skip_forward(it->b, start, BUF_CLS_NL, 0);
+    it->next = end < buf_len(it->b) ? end + 1 : BUF_NPOS;
+    buf_line_view(it->b, start, end, out);
+    return start;
+}
+
+size_t buf_line_prev(buf_line_iter *it, buf_slice out[2])
+{
+    size_t start, end;
+
+    if (!it || (end = it->prev) == BUF_NPOS)
+        return BUF_NPOS;
+    start = buf_skip_backward(it->b, end, BUF_CLS_NL, 0);
+    it->prev = start ? start - 1 : BUF_NPOS;
+    buf_line_view(it->b, start, end, out);
+    return start;
+}
+/*---------------------------------------------------------------------------*/
+#ifdef BUF_USE_THREADS
+typedef struct {
+    const Buffer *b;
+    const buf_kernel *k;
+    size_t pos;
+    size_t end;
+    size_t stripe;
+    size_t nstripes;
+    size_t stride;
+    uint8_t *states;
+    size_t next; /* next stripe to take, atomic */
+} buf_par_job;
+
+/* One pool for the process; scans from several threads take turns. */
+static struct {
+    pthread_mutex_t run; /* held for a whole scan */
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t th[BUF_PAR_MAX_THREADS];
+    unsigned n;    /* workers, not counting the caller */
+    unsigned want; /* 0 until set or started */
+    unsigned gen;
+    unsigned busy;
+    int stop;
+    buf_par_job *job;
+} buf_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    {0}, 0, 0, 0, 0, 0, NULL
+};
+
+static void buf_par_work(buf_par_job *j)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t i, from, to, off, m;
+    void *st;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->nstripes) {
+        from = j->pos + i * j->stripe;
+        to = from + j->stripe < j->end ? from + j->stripe : j->end;
+        st = j->states + i * j->stride;
+        if (from >= to)
+            continue;
+        for (buf_iter_init(&it, j->b, from, to - from); buf_iter_next(&it, &s); from += s.len)
+            for (off = 0; off < s.len; off += m) {
+                m = s.len - off < BUF_PAR_CHUNK ? s.len - off : BUF_PAR_CHUNK;
+                j->k->chunk(j->k->ctx, st, from + off, s.ptr + off, m);
+            }
+    }
+}
+
+/* arg is the generation at creation: a job posted before the thread got
+ * to run must still count as new */
+static void *buf_pool_main(void *arg)
+{
+    unsigned seen;
+    buf_par_job *j;
+
+    pthread_mutex_lock(&buf_pool.mu);
+    for (seen = (unsigned)(uintptr_t)arg;;) {
+        while (!buf_pool.stop && buf_pool.gen == seen)
+            pthread_cond_wait(&buf_pool.wake, &buf_pool.mu);
+        if (buf_pool.stop)
+            break;
+        seen = buf_pool.gen;
+        j = buf_pool.job;
+        pthread_mutex_unlock(&buf_pool.mu);
+        buf_par_work(j);
+        pthread_mutex_lock(&buf_pool.mu);
+        if (!--buf_pool.busy)
+            pthread_cond_signal(&buf_pool.done);
+    }
+    pthread_mutex_unlock(&buf_pool.mu);
+    return NULL;
+}
+
+/* with run held */
+static void buf_pool_stop(void)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&buf_pool.mu);
+    buf_pool.stop = 1;
+    pthread_cond_broadcast(&buf_pool.wake);
+    pthread_mutex_unlock(&buf_pool.mu);
+    for (i = 0; i < buf_pool.n; ++i)
+        pthread_join(buf_pool.th[i], NULL);
+    buf_pool.n = 0;
+    buf_pool.stop = 0;
+}
+
+/* with run held */
+static void buf_pool_start(void)
+{
+    long cpus;
+
+    if (!buf_pool.want) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        buf_pool.want = cpus > 1 ? (unsigned)cpus : 1;
+    }
+    if (buf_pool.want > BUF_PAR_MAX_THREADS + 1)
+        buf_pool.want = BUF_PAR_MAX_THREADS + 1;
+    while (buf_pool.n + 1 < buf_pool.want
+            && !pthread_create(&buf_pool.th[buf_pool.n], NULL, buf_pool_main,
+                (void *)(uintptr_t)buf_pool.gen))
+        ++buf_pool.n;
+}
+
+int buf_par_threads(unsigned n)
+{
+    pthread_mutex_lock(&buf_pool.run);
+    buf_pool_stop();
+    buf_pool.want = n;
+    if (n > 1)
+        buf_pool_start();
+    pthread_mutex_unlock(&buf_pool.run);
+    return 1;
+}
+
+int buf_par_scan(const Buffer *b, size_t pos, size_t n, const buf_kernel *k, void *result)
+{
+    buf_par_job j;
+    size_t i, len, nchunks;
+    unsigned workers;
+
+    buf_assert(b);
+    if (!b || !k || !k->chunk || !k->merge || !result || !BUF_THAW(b))
+        return 0;
+    len = buf_len(b);
+    pos = pos < len ? pos : len;
+    memset(&j, 0, sizeof(j));
+    j.b = b;
+    j.k = k;
+    j.pos = pos;
+    j.end = (!n || n > len - pos) ? len : pos + n;
+    j.stride = (k->state_size + 63) / 64 * 64; /* no false sharing */
+
+    pthread_mutex_lock(&buf_pool.run);
+    if (!buf_pool.n && buf_pool.want != 1)
+        buf_pool_start();
+    workers = buf_pool.n;
+    nchunks = (j.end - j.pos + BUF_PAR_CHUNK - 1) / BUF_PAR_CHUNK;
+    j.nstripes = (workers + 1) * 4 < nchunks ? (workers + 1) * 4 : nchunks;
+    j.nstripes = j.nstripes ? j.nstripes : 1;
+    j.stripe = (j.end - j.pos + j.nstripes - 1) / j.nstripes;
+    j.stripe = j.stripe ? j.stripe : 1;
+    if (!(j.states = (uint8_t *)buf_mem_realloc(b, NULL, 0, j.nstripes * j.stride + 1))) {
+        pthread_mutex_unlock(&buf_pool.run);
+        return 0;
+    }
+    for (i = 0; i < j.nstripes; ++i)
+        if (k->init)
+            k->init(k->ctx, j.states + i * j.stride);
+
+    if (workers && j.nstripes > 1) {
+        pthread_mutex_lock(&buf_pool.mu);
+        buf_pool.job = &j;
+        buf_pool.busy = workers;
+        ++buf_pool.gen;
+        pthread_cond_broadcast(&buf_pool.wake);
+        pthread_mutex_unlock(&buf_pool.mu);
+        buf_par_work(&j);
+        pthread_mutex_lock(&buf_pool.mu);
+        while (buf_pool.busy)
+            pthread_cond_wait(&buf_pool.done, &buf_pool.mu);
+        pthread_mutex_unlock(&buf_pool.mu);
+    } else {
+        buf_par_work(&j);
+    }
+    pthread_mutex_unlock(&buf_pool.run);
+
+    if (k->init)
+        k->init(k->ctx, result);
+    for (i = 0; i < j.nstripes; ++i)
+        k->merge(k->ctx, result, j.states + i * j.stride);
+    buf_mem_free(b, j.states, j.nstripes * j.stride + 1);
+    return 1;
+}
+
+/* built-in kernels, all summing size_t counters */
+static void buf_par_zero(void *ctx, void *st)
+{
+    (void)ctx;
+    *(size_t *)st = 0;
+}
+
+static void buf_par_add(void *ctx, void *into, const void *next)
+{
+    (void)ctx;
+    *(size_t *)into += *(const size_t *)next;
+}
+
+static void buf_par_byte(void *ctx, void *st, size_t pos, const uint8_t *p, size_t n)
+{
+    uint8_t c = *(const uint8_t *)ctx;
+    size_t i = 0, cnt = 0;
+
+    (void)pos;
+#ifdef BUF_SIMD_W
+    for (; i + BUF_SIMD_W <= n; i += BUF_SIMD_W)
+        cnt += __builtin_popcountll(buf_eq2_mask(p + i, p + i, c, c)) / BUF_SIMD_BPB;
+#endif
+    for (; i < n; ++i)
+        cnt += p[i] == c;
+    *(size_t *)st += cnt;
+}
+
+size_t buf_par_count_byte(const Buffer *b, uint8_t c)
+{
+    buf_kernel k = { sizeof(size_t), buf_par_zero, buf_par_byte, buf_par_add, NULL };
+    size_t r = 0;
+
+    k.ctx = &c;
+    buf_par_scan(b, 0, 0, &k, &r);
+    return r;
+}
+
+size_t buf_par_count_lines(const Buffer *b)
+{
+    return buf_par_count_byte(b, '\n') + 1;
+}
+
+typedef struct {
+    const Buffer *b;
+    const buf_pattern *p;
+} buf_par_find;
+
+/* matches that start in [pos, pos+n). Those that run past the end are
+ * scanned in a window after the count in st: the last m-1 bytes of the
+ * run and the m-1 that follow it, read from the buffer. */
+static void buf_par_pat(void *ctx, void *st, size_t pos, const uint8_t *p, size_t n)
+{
+    const buf_par_find *f = (const buf_par_find *)ctx;
+    uint8_t *w = (uint8_t *)st + sizeof(size_t);
+    size_t i, r, t, len, cnt = 0, m = f->p->n;
+
+    for (i = 0; (r = buf_scan(p + i, n - i, f->p)) != BUF_NPOS; i += r + 1)
+        ++cnt;
+    t = n < m - 1 ? n : m - 1;
+    len = buf_read(f->b, pos + n - t, w, t + m - 1);
+    for (i = 0; (r = buf_scan(w + i, len - i, f->p)) != BUF_NPOS && i + r < t; i += r + 1)
+        ++cnt;
+    *(size_t *)st += cnt;
+}
+
+size_t buf_par_count(const Buffer *b, const buf_pattern *p)
+{
+    buf_kernel k = { sizeof(size_t), buf_par_zero, buf_par_pat, buf_par_add, NULL };
+    buf_par_find f;
+    size_t r = 0;
+
+    if (!p || !p->n)
+        return 0;
+    f.b = b;
+    f.p = p;
+    k.ctx = &f;
+    k.state_size += 2 * (p->n - 1); /* the window */
+    buf_par_scan(b, 0, 0, &k, &r);
+    return r;
+}
+
+static void buf_par_hzero(void *ctx, void *st)
+{
+    (void)ctx;
+    memset(st, 0, 256 * sizeof(uint64_t));
+}
+
+static void buf_par_hadd(void *ctx, void *into, const void *next)
+{
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < 256; ++i)
+        ((uint64_t *)into)[i] += ((const uint64_t *)next)[i];
+}
+
+static void buf_par_hist(void *ctx, void *st, size_t pos, const uint8_t *p, size_t n)
+{
+    uint64_t *h = (uint64_t *)st;
+    size_t i;
+
+    (void)ctx; (void)pos;
+    for (i = 0; i < n; ++i)
+        ++h[p[i]];
+}
+
+int buf_par_histogram(const Buffer *b, uint64_t hist[256])
+{
+    buf_kernel k = { 256 * sizeof(uint64_t), buf_par_hzero, buf_par_hist, buf_par_hadd, NULL };
+
+    return buf_par_scan(b, 0, 0, &k, hist);
+}
+#endif /* BUF_USE_THREADS */
+
+#ifdef BUF_USE_POSIX
+int buf_open_mmap(Buffer *b, int fd)
+{
+    struct stat st;
+    size_t len;
+    int ok;
+
+    buf_assert(b);
+    if (!b || fstat(fd, &st) < 0 || st.st_size < 0)
+        return 0;
+    len = st.st_size;
+#ifdef BUF_USE_CHUNKS
+    /* chunks are private blocks: the file is read, not mapped */
+#ifdef BUF_USE_OBSERVE
+    size_t old = buf_len(b);
+#endif
+
+    if (!buf_chunk_load(b, fd, len))
+        return 0;
+#ifdef BUF_USE_OBSERVE
+    if (old || len)
+        buf_obs_add(b, 0, old, len);
+#endif
+    b->gap_start = b->gap_end = b->cursor = len;
+#else
+    size_t cap, page;
+    uint8_t *p;
+
+    /* the gap a fresh buffer would get, as the growth policy sizes it */
+    cap = buf_grow_cap(b, 0, len + buf_growth_init(buf_growth_of(b)));
+    if (cap <= len)
+        return 0;
+    page = sysconf(_SC_PAGESIZE);
+    cap = (cap + page - 1) / page * page;
+
+    /* reserve room for the gap, then lay the file over the front of it */
+    p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    if (len && mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, 0) == MAP_FAILED) {
+        munmap(p, cap);
+        return 0;
+    }
+
+#ifdef BUF_USE_OBSERVE
+    if (buf_len(b) || len)
+        buf_obs_add(b, 0, buf_len(b), len);
+#endif
+#ifdef BUF_USE_FREEZE
+    buf_frz_drop(b);
+#endif
+    buf_release(b);
+    b->data = p;
+    b->capacity = cap;
+    BUF_STAT(buf_stats_cap(cap));
+    b->flags &= ~BUF_F_BORROWED;
+    b->flags |= BUF_F_MAPPED | BUF_F_FILE;
+    b->gap_start = b->cursor = len;
+    b->gap_end = cap;
+#endif
+    buf_assert(b);
+    ok = buf_reindex(b);
+#ifdef BUF_USE_OBSERVE
+    buf_obs_flush(b);
+#endif
+    return ok;
+}
+
+int buf_write_fd(const Buffer *b, int fd, size_t pos, size_t n)
+{
+    buf_iter it;
+    buf_slice s;
+    struct iovec iov[16];
+    int i, cnt, more;
+    ssize_t w;
+
+    buf_assert(b);
+    if (!b || pos >= buf_len(b) || !BUF_THAW(b))
+        return b && pos == buf_len(b);
+
+    /* the runs of storage go out up to 16 at a time */
+    buf_iter_init(&it, b, pos, n);
+    do {
+        for (cnt = 0; cnt < 16 && (more = buf_iter_next(&it, &s)); ++cnt) {
+            iov[cnt].iov_base = (void *)s.ptr;
+            iov[cnt].iov_len = s.len;
+        }
+        for (i = 0; i < cnt;) {
+            w = writev(fd, iov + i, cnt - i);
+            if (w < 0 && errno == EINTR)
+                continue;
+            /* 0 bytes for a non-empty write would just repeat forever */
+            if (w <= 0)
+                return 0;
+            for (; i < cnt && (size_t)w >= iov[i].iov_len; ++i)
+                w -= iov[i].iov_len;
+            if (i < cnt) {
+                iov[i].iov_base = (uint8_t *)iov[i].iov_base + w;
+                iov[i].iov_len -= w;
+            }
+        }
+    } while (more);
+    return 1;
+}
+
+int buf_save(const Buffer *b, const char *path)
+{
+    struct stat st;
+    char *tmp;
+    int fd, ok;
+
+    buf_assert(b);
+    if (!b || !path)
+        return 0;
+    tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (!tmp)
+        return 0;
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        free(tmp);
+        return 0;
+    }
+
+    ok = fchmod(fd, stat(path, &st) == 0 ? st.st_mode & 07777 : 0644) == 0
+        && buf_write_fd(b, fd, 0, 0)
+        && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+#endif /* BUF_USE_POSIX */
+
+#ifdef BUF_USE_JOURNAL
+int buf_journal_replay(Buffer *b, const char *path, int log_fd, const buf_journal_conf *conf)
+{
+    static const buf_journal_conf def = { BUF_JOURNAL_SYNC_MS, 100 };
+    struct buf_journal *j;
+    struct stat st;
+    uint8_t h[BUF_JHDR], *p;
+    size_t n, good;
+    int fd, ok;
+
+    buf_assert(b);
+    if (!b || !path || b->journal || fstat(log_fd, &st) < 0)
+        return 0;
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        ok = buf_open_mmap(b, fd);
+        close(fd);
+        if (!ok)
+            return 0;
+    } else if (errno == ENOENT) {
+        buf_reset(b);
+    } else {
+        return 0;
+    }
+
+    good = 0;
+    n = st.st_size;
+    if (n >= BUF_JHDR) {
+        p = (uint8_t *)mmap(NULL, n, PROT_READ, MAP_PRIVATE, log_fd, 0);
+        if (p == MAP_FAILED)
+            return 0;
+        good = buf_journal_apply(b, p, n);
+        munmap(p, n);
+        if (good == (size_t)-1)
+            return 0;
+    }
+    if (!good) {
+        buf_journal_header(h, b);
+        if (ftruncate(log_fd, 0) < 0 || pwrite(log_fd, h, BUF_JHDR, 0) != BUF_JHDR)
+            return 0;
+        good = BUF_JHDR;
+    } else if (good < n && ftruncate(log_fd, good) < 0) {
+        return 0;
+    }
+    if (fdatasync(log_fd) < 0)
+        return 0;
+
+    if (!(j = (struct buf_journal *)buf_mem_realloc(b, NULL, 0, sizeof(*j))))
+        return 0;
+    memset(j, 0, sizeof(*j));
+    n = strlen(path) + 1;
+    if (!(j->path = (char *)buf_mem_realloc(b, NULL, 0, n))) {
+        buf_mem_free(b, j, sizeof(*j));
+        return 0;
+    }
+    memcpy(j->path, path, n);
+    j->fd = log_fd;
+    j->conf = conf ? *conf : def;
+    j->size = good;
+    j->last = buf_ms();
+    b->journal = j;
+#ifdef BUF_USE_UNDO
+    buf_undo_clear(b);
+#endif
+    return 1;
+}
+
+int buf_journal_sync(Buffer *b)
+{
+    buf_assert(b);
+    if (!b || !b->journal)
+        return 0;
+    return buf_journal_commit(b->journal, 1);
+}
+
+int buf_journal_checkpoint(Buffer *b)
+{
+    struct buf_journal *j;
+    uint8_t h[BUF_JHDR];
 
-#ifdef USE_EXTENTION
-int buf_forward_char(Buffer *b);
-int buf_backward_char(Buffer *b);
-int buf_forward_word(Buffer *b);
-int buf_backward_word(Buffer *b);
-int buf_home(Buffer *b);
-int buf_end(Buffer *b);
-int buf_kill_word(Buffer *b);
-int buf_kill_line(Buffer *b);
-int buf_line_discard(Buffer *b);
-int buf_word_rubout(Buffer *b);
-#endif /* USE_EXTENTION */
+    buf_assert(b);
+    if (!b || !(j = b->journal))
+        return 0;
+    /* the old log stays good until the new file is in place */
+    if (!buf_save(b, j->path) || !buf_sync_dir(j->path))
+        return 0;
+    buf_journal_header(h, b);
+    j->len = j->mark = 0;
+    if (ftruncate(j->fd, 0) < 0 || pwrite(j->fd, h, BUF_JHDR, 0) != BUF_JHDR
+            || fdatasync(j->fd) < 0)
+        return !(j->err = 1);
+    j->size = BUF_JHDR;
+    j->err = 0;
+    j->last = buf_ms();
+    return 1;
+}
 
-#ifdef __cplusplus
+int buf_journal_close(Buffer *b)
+{
+    struct buf_journal *j;
+    int ok;
+
+    if (!b || !(j = b->journal))
+        return 0;
+    ok = buf_journal_commit(j, 1);
+    buf_mem_free(b, j->buf, j->cap);
+    buf_mem_free(b, j->path, strlen(j->path) + 1);
+    buf_mem_free(b, j, sizeof(*j));
+    b->journal = NULL;
+    return ok;
 }
-#endif
+#endif /* BUF_USE_JOURNAL */
 
-#ifdef GBF_IMPLEMENTATION
+#ifdef BUF_USE_LINES
+size_t buf_line_count(const Buffer *b)
+{
+    return b ? buf_offv_len(&b->lines) + 1 : 0;
+}
 
-void buf_new(Buffer *b)
+size_t buf_line_to_offset(const Buffer *b, size_t line)
 {
-    if (!b)
-        return;
-    memset(b, 0, sizeof(*b));
+    buf_assert(b);
+    if (!line)
+        return 0;
+    if (line >= buf_line_count(b))
+        return buf_len(b);
+    return buf_offv_at(&b->lines, line - 1, buf_len(b)) + 1;
 }
 
-void buf_reset(Buffer *b)
+size_t buf_offset_to_line(const Buffer *b, size_t pos)
 {
-    if (!b)
-        return;
-    b->gap_start = 0;
-    b->gap_end = b->capacity;
+    buf_assert(b);
+    return buf_offv_rank(&b->lines, pos, buf_len(b));
 }
+#endif /* BUF_USE_LINES */
 
-void buf_free(Buffer *b)
+#ifdef BUF_USE_MARKS
+size_t buf_mark_new(Buffer *b, size_t pos, int sticky)
 {
-    if (!b)
-        return;
-    free(b->data);
-    b->data = NULL;
-    b->capacity = 0;
+    size_t id, n, i, *p;
+
+    buf_assert(b);
+    if (!b || pos > buf_len(b) || !buf_marks_reserve(b))
+        return BUF_NPOS;
+    if (!b->marks.free) {
+        n = b->marks.nslot ? b->marks.nslot * 2 : 64;
+        p = buf_mem_realloc(b, b->marks.slot, b->marks.nslot * sizeof(*p), n * sizeof(*p));
+        if (!p)
+            return BUF_NPOS;
+        for (i = b->marks.nslot; i < n; ++i)
+            p[i] = BUF_MARK_FREE | (i + 1 < n ? i + 2 : 0);
+        b->marks.slot = p;
+        b->marks.free = b->marks.nslot + 1;
+        b->marks.nslot = n;
+    }
+    id = b->marks.free - 1;
+    b->marks.free = b->marks.slot[id] & ~BUF_MARK_FREE;
+    buf_marks_place(b, id, pos, sticky == BUF_MARK_RIGHT);
+    return id;
 }
-/*---------------------------------------------------------------------------*/
-/* Invariants:
- *   0 <= gap_start <= gap_end <= capacity
- *   Text length = capacity - (gap_end - gap_start)
- * Cursor is always at gap_start.
- * All operations are byte-based (no UTF-8 awareness yet). */
-static void buf_assert(const Buffer *b);
-static void buf_move_gap(Buffer *b, size_t pos);
-static int buf_reserve(Buffer *b, size_t new_size);
-static size_t buf_gap_len(const Buffer *b);
 
-static void buf_assert(const Buffer *b)
+size_t buf_mark_get(const Buffer *b, size_t id)
 {
-    assert(b);
-    assert(b->gap_start <= b->gap_end);
-    assert(b->gap_end <= b->capacity);
-    assert(b->data || b->capacity == 0);
+    size_t i;
+
+    buf_assert(b);
+    if (!b || !buf_marks_live(b, id))
+        return BUF_NPOS;
+    i = b->marks.slot[id];
+    return i < b->marks.off.lo ? b->marks.off.v[i] : buf_len(b) - b->marks.off.v[i];
 }
 
-static void buf_move_gap(Buffer *b, size_t pos)
+int buf_mark_set(Buffer *b, size_t id, size_t pos)
 {
-    size_t n;
-    if (pos == b->gap_start)
-        return;
+    int right;
 
-    if (pos < b->gap_start) {
-        n = b->gap_start - pos;
-        memmove(b->data + b->gap_end - n, b->data + pos, n);
-        b->gap_end -= n;
-        b->gap_start -= n;
-    } else {
-        n = pos - b->gap_start;
-        memmove(b->data + b->gap_start, b->data + b->gap_end, n);
-        b->gap_start += n;
-        b->gap_end += n;
-    }
+    buf_assert(b);
+    if (!b || !buf_marks_live(b, id) || pos > buf_len(b))
+        return 0;
+    right = b->marks.tag[b->marks.slot[id]] & 1;
+    buf_marks_remove(b, id);
+    buf_marks_place(b, id, pos, right);
+    return 1;
 }
 
-static int buf_reserve(Buffer *b, size_t new_size)
+void buf_mark_free(Buffer *b, size_t id)
 {
-    size_t ncap;
-    uint8_t *p;
+    buf_assert(b);
+    if (!b || !buf_marks_live(b, id))
+        return;
+    buf_marks_remove(b, id);
+    b->marks.slot[id] = BUF_MARK_FREE | b->marks.free;
+    b->marks.free = id + 1;
+}
 
-    if (buf_gap_len(b) >= new_size)
-        return 1;
-    size_t buflen = buf_len(b);
-    ncap = b->capacity ? b->capacity : BUF_INIT_SIZE;
-    while ((ncap - buflen) < new_size)
-        ncap *= 2;
-    p = realloc(b->data, ncap);
-    if (!p)
+size_t buf_mark_range(const Buffer *b, size_t from, size_t to, size_t *out, size_t max)
+{
+    const buf_offv *o;
+    size_t i, lo, hi, len;
+
+    buf_assert(b);
+    if (!b || from >= to)
         return 0;
-    b->data = p;
+    o = &b->marks.off;
+    len = buf_len(b);
+    lo = buf_offv_rank(o, from, len);
+    hi = buf_offv_rank(o, to, len);
+    for (i = lo; i < hi && i - lo < max; ++i)
+        *out++ = b->marks.tag[i < o->lo ? i : i + (o->hi - o->lo)] >> 1;
+    return hi - lo;
+}
+#endif /* BUF_USE_MARKS */
 
-    size_t n, nend;
-    n = b->capacity - b->gap_end;
-    nend = ncap - n;
-    memmove(b->data + nend, b->data + b->gap_end, n);
-    b->gap_end = nend;
-    b->capacity = ncap;
+#ifdef BUF_USE_UTF8
+/* Validate with a vector scan over ASCII runs; multibyte sequences are
+ * checked one at a time, rejecting overlongs, surrogates and > U+10FFFF. */
+int buf_utf8_valid(const uint8_t *s, size_t n)
+{
+    size_t i, k, len;
+    uint8_t c, lo, hi;
 
+    for (i = 0; i < n; i += len) {
+        i += buf_cls_span(s + i, n - i, BUF_CLS_HIGH, 0);
+        if (i == n)
+            break;
+        c = s[i];
+        lo = 0x80;
+        hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            return 0;
+        }
+        if (n - i < len || s[i + 1] < lo || s[i + 1] > hi)
+            return 0;
+        for (k = 2; k < len; ++k)
+            if (!BUF_UTF8_CONT(s[i + k]))
+                return 0;
+    }
     return 1;
 }
 
-static size_t buf_gap_len(const Buffer *b)
+int buf_cat_utf8(Buffer *b, const uint8_t *s, size_t n)
 {
-    return b->gap_end - b->gap_start;
+    if (!b || !s)
+        return 0;
+    n = n ? n : strlen((const char *)s);
+    return buf_utf8_valid(s, n) && buf_cat(b, s, n);
 }
-/*---------------------------------------------------------------------------*/
-size_t buf_len(const Buffer *b)
+
+static uint8_t buf_at(const Buffer *b, size_t pos)
 {
-    return b ? b->capacity - (b->gap_end - b->gap_start) : 0;
+    buf_slice s;
+    size_t start;
+
+    start = buf_run(b, pos, &s);
+    return s.ptr[pos - start];
 }
 
-size_t buf_cursor(const Buffer *b)
+size_t buf_next_cp(const Buffer *b, size_t pos)
 {
-    return b ? b->gap_start : 0;
+    size_t len;
+
+    buf_assert(b);
+    len = buf_len(b);
+    if (pos >= len || !BUF_THAW(b))
+        return pos < len ? pos : len;
+    for (++pos; pos < len && BUF_UTF8_CONT(buf_at(b, pos)); ++pos);
+    return pos;
 }
 
-int buf_cursor_set(Buffer *b, size_t pos)
+size_t buf_prev_cp(const Buffer *b, size_t pos)
 {
     buf_assert(b);
     if (pos > buf_len(b))
-        return 0;
-    buf_move_gap(b, pos);
-    return 1;
+        pos = buf_len(b);
+    if (!pos || !BUF_THAW(b))
+        return pos;
+    for (--pos; pos && BUF_UTF8_CONT(buf_at(b, pos)); --pos);
+    return pos;
 }
 
-int buf_cursor_move(Buffer *b, ptrdiff_t delta)
+/* offset n codepoints away from the cursor, or -1 */
+static ptrdiff_t buf_cp_seek(const Buffer *b, ptrdiff_t n)
+{
+    size_t pos, next;
+
+    pos = buf_cursor(b);
+    for (; n > 0; --n, pos = next)
+        if ((next = buf_next_cp(b, pos)) == pos)
+            return -1;
+    for (; n < 0; ++n, pos = next)
+        if ((next = buf_prev_cp(b, pos)) == pos)
+            return -1;
+    return pos;
+}
+
+int buf_cursor_move_cp(Buffer *b, ptrdiff_t n)
 {
     ptrdiff_t pos;
+
     buf_assert(b);
-    pos = (ptrdiff_t)b->gap_start + delta;
-    if (pos < 0 || (size_t)pos > buf_len(b))
+    if (!b || (pos = buf_cp_seek(b, n)) < 0)
         return 0;
     return buf_cursor_set(b, pos);
 }
 
-/* add a byte */
-int buf_ccat(Buffer *b, uint8_t c)
+int buf_delete_cp(Buffer *b, ptrdiff_t n)
 {
+    ptrdiff_t pos;
+
     buf_assert(b);
-    if (!b || !buf_reserve(b, 1))
+    if (!b || (pos = buf_cp_seek(b, n)) < 0)
         return 0;
-    b->data[b->gap_start++] = c;
-    buf_assert(b);
-    return 1;
+    return buf_delete(b, pos - (ptrdiff_t)buf_cursor(b));
 }
-/* n == 0, treat as cstr */
-int buf_cat(Buffer *b, const uint8_t *s, size_t n)
+
+size_t buf_cp_count(const Buffer *b)
 {
     buf_assert(b);
-    if (!b || !s)
-        return 0;
-    n = n ? n : strlen((const char *)s);
-    if (!buf_reserve(b, n))
-        return 0;
-    memcpy(b->data + b->gap_start, s, n);
-    b->gap_start += n;
+    return b ? b->utf8.total : 0;
+}
+
+size_t buf_cp_to_offset(const Buffer *b, size_t cp)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t i, pos, len;
+
     buf_assert(b);
-    return 1;
+    len = buf_len(b);
+    if (cp >= b->utf8.total)
+        return len;
+    i = buf_offv_rank(&b->utf8.cnt, cp + 1, b->utf8.total);
+    pos = i ? buf_offv_at(&b->utf8.off, i - 1, len) : 0;
+    cp -= i ? buf_offv_at(&b->utf8.cnt, i - 1, b->utf8.total) : 0;
+    for (buf_iter_init(&it, b, pos, 0); buf_iter_next(&it, &s); pos += s.len)
+        for (i = 0; i < s.len; ++i)
+            if (!BUF_UTF8_CONT(s.ptr[i]) && !cp--)
+                return pos + i;
+    return len;
 }
 
-int buf_insert(Buffer *b, size_t pos, const uint8_t *s, size_t n)
+size_t buf_offset_to_cp(const Buffer *b, size_t pos)
 {
+    size_t i, p0, len;
+
     buf_assert(b);
-    if (!b || !s)
-        return 0;
-    if (!buf_cursor_set(b, pos))
-        return 0;
-    return buf_cat(b, s, n);
+    len = buf_len(b);
+    if (pos >= len || !BUF_THAW(b))
+        return b->utf8.total;
+    i = buf_offv_rank(&b->utf8.off, pos + 1, len);
+    p0 = i ? buf_offv_at(&b->utf8.off, i - 1, len) : 0;
+    return (i ? buf_offv_at(&b->utf8.cnt, i - 1, b->utf8.total) : 0)
+        + buf_utf8_count_at(b, p0, pos - p0);
 }
+#endif /* BUF_USE_UTF8 */
 
-int buf_delete(Buffer *b, ptrdiff_t delta)
+#ifdef BUF_USE_UNDO
+int buf_undo(Buffer *b)
 {
+    buf_urec r;
+    size_t rs;
+    int ok;
+
     buf_assert(b);
-    if (!b || ! delta)
+    if (!b || !b->undo.top)
         return 0;
-    if (delta > 0) {
-        if ((size_t)delta > buf_len(b) - buf_cursor(b))
-            return 0;
-        b->gap_end += delta;
-    } else if (delta < 0){
-        if ((ptrdiff_t)b->gap_start + delta < 0)
-            return 0;
-        b->gap_start += delta;
+    rs = buf_undo_get(b, b->undo.top, &r);
+    b->undo.busy = 1;
+    if (r.kind == BUF_UNDO_INS)
+        ok = buf_cursor_set(b, r.pos) && buf_delete(b, r.len);
+    else
+        ok = buf_insert(b, r.pos, b->undo.data + rs + sizeof(r), r.len);
+    b->undo.busy = 0;
+    if (ok) {
+        b->undo.top = rs;
+        b->undo.seal = 1;
     }
-    buf_assert(b);
-    return 1;
+    return ok;
 }
-/*---------------------------------------------------------------------------*/
 
-size_t buf_read(const Buffer *b, size_t pos, uint8_t *dst, size_t n)
+int buf_redo(Buffer *b)
 {
-    size_t buflen;
+    buf_urec r;
+    size_t rs;
+    int ok;
 
     buf_assert(b);
-    buflen = buf_len(b);
-    if (!b || !dst || !n || pos >= buflen)
+    if (!b || b->undo.top == b->undo.len)
         return 0;
+    rs = b->undo.top;
+    memcpy(&r, b->undo.data + rs, sizeof(r));
+    b->undo.busy = 1;
+    if (r.kind == BUF_UNDO_INS)
+        ok = buf_insert(b, r.pos, b->undo.data + rs + sizeof(r), r.len);
+    else
+        ok = buf_cursor_set(b, r.pos) && buf_delete(b, r.len);
+    b->undo.busy = 0;
+    if (ok) {
+        b->undo.top = rs + BUF_UREC_SIZE(r.len);
+        b->undo.seal = 1;
+    }
+    return ok;
+}
 
-    if (pos + n > buflen)
-        n = buflen - pos;
+void buf_undo_seal(Buffer *b)
+{
+    if (b)
+        b->undo.seal = 1;
+}
 
-    if (pos > b->gap_start) {
-        memcpy(dst, b->data + pos + buf_gap_len(b), n);
-    } else {
-        if (pos + n <= b->gap_start)
-            memcpy(dst, b->data + pos, n);
-        else {
-            size_t ncpy = b->gap_start - pos;
-            memcpy(dst, b->data + pos, ncpy);
-            memcpy(dst + ncpy, b->data + b->gap_end, n - ncpy);
-        }
-    }
-    return n;
+void buf_undo_limit(Buffer *b, size_t bytes)
+{
+    if (!b)
+        return;
+    b->undo.limit = bytes;
+    buf_undo_trim(b, 0);
+    buf_undo_fit(b);
 }
 
-/* n == 0 add [pos, buflen]  */
-size_t buf_view(const Buffer *b, size_t pos, size_t n, buf_slice out[2])
+void buf_undo_clear(Buffer *b)
 {
-    size_t buflen;
+    if (b)
+        b->undo.len = b->undo.top = 0;
+}
+#endif /* BUF_USE_UNDO */
 
-    buf_assert(b);
-    buflen = buf_len(b);
-    if (!b || !out || pos >= buflen)
+#ifdef BUF_USE_DAMAGE
+int buf_damage_take(Buffer *b, buf_change *out)
+{
+    if (!b || !b->damage.dirty)
         return 0;
+    if (out)
+        *out = b->damage.range;
+    b->damage.dirty = 0;
+    b->damage.base = buf_len(b);
+    return 1;
+}
+#endif /* BUF_USE_DAMAGE */
 
-    if (pos + n > buflen || !n)
-        n = buflen - pos;
-
+#ifdef BUF_USE_OBSERVE
+int buf_observe(Buffer *b, buf_observer_fn fn, void *ctx)
+{
+    struct buf_observer *v;
+    size_t cap;
 
-    memset(out, 0, sizeof(*out)*2);
-    if (pos >= b->gap_start) {
-        out->len = n;
-        out->ptr = b->data + pos + buf_gap_len(b);
-    } else {
-        out->ptr = b->data + pos;
-        if (pos + n <= b->gap_start)
-            out->len = n;
-        else {
-            out->len = b->gap_start - pos;
-            out[1].len = n - out->len;
-            out[1].ptr = b->data + b->gap_end;
-        }
+    if (!b || !fn)
+        return 0;
+    if (b->obs.n == b->obs.cap) {
+        cap = b->obs.cap ? b->obs.cap * 2 : 4;
+        v = buf_mem_realloc(b, b->obs.v, b->obs.cap * sizeof(*v), cap * sizeof(*v));
+        if (!v)
+            return 0;
+        b->obs.v = v;
+        b->obs.cap = cap;
     }
-    return n;
+    b->obs.v[b->obs.n].fn = fn;
+    b->obs.v[b->obs.n++].ctx = ctx;
+    return 1;
 }
 
-uint8_t *buf_flatten(const Buffer *b)
+int buf_unobserve(Buffer *b, buf_observer_fn fn, void *ctx)
 {
-    uint8_t *buf;
-    size_t h, t, buflen;
+    size_t i;
 
-    buf_assert(b);
     if (!b)
-        return NULL;
-
-#ifdef GAP_DEBUG
-    buflen = b->capacity;
-#else
-    buflen = buf_len(b);
-#endif
-    buf = malloc(buflen + 1);
-    if (!buf)
-        return NULL;
-    h = b->gap_start;
-    t = b->capacity - b->gap_end;
+        return 0;
+    for (i = 0; i < b->obs.n; ++i) {
+        if (b->obs.v[i].fn == fn && b->obs.v[i].ctx == ctx) {
+            memmove(b->obs.v + i, b->obs.v + i + 1, (b->obs.n - i - 1) * sizeof(*b->obs.v));
+            if (!--b->obs.n)
+                b->obs.dirty = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    memcpy(buf, b->data, h);
-#ifdef GAP_DEBUG
-    size_t gap = buf_gap_len(b);
-    memset(buf + h, '_', gap);
-    memcpy(buf + h + gap, b->data + b->gap_end, t);
-#else
-    memcpy(buf + h, b->data + b->gap_end, t);
-#endif
-    buf[buflen] = '\0';
+void buf_batch_begin(Buffer *b)
+{
+    if (b)
+        ++b->obs.batch;
+}
 
-    buf_assert(b);
-    return buf;
+void buf_batch_end(Buffer *b)
+{
+    if (!b || !b->obs.batch)
+        return;
+    --b->obs.batch;
+    buf_obs_flush(b);
 }
+#endif /* BUF_USE_OBSERVE */
 
 #ifdef USE_EXTENTION
+/* whole codepoints with BUF_USE_UTF8, bytes otherwise */
 int buf_forward_char(Buffer *b)
 {
     buf_assert(b);
+#ifdef BUF_USE_UTF8
+    return buf_cursor_move_cp(b, 1);
+#else
     return buf_cursor_move(b, 1);
+#endif
 }
 
 int buf_backward_char(Buffer *b)
 {
     buf_assert(b);
+#ifdef BUF_USE_UTF8
+    return buf_cursor_move_cp(b, -1);
+#else
     return buf_cursor_move(b, -1);
+#endif
 }
 
 int buf_forward_word(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, buf_cursor(b), 0, s) || s[1].len)
+    if (!b || buf_cursor(b) == buf_len(b))
         return 0;
-
-    ptrdiff_t d;
-    for (d = 0; d < (ptrdiff_t)s->len && !isalnum(s->ptr[d]); ++d);
-    for (;d < (ptrdiff_t)s->len && isalnum(s->ptr[d]); ++d);
-    return buf_cursor_move(b, d);
+    pos = buf_skip_forward(b, buf_cursor(b), BUF_CLS_ALNUM, 0);
+    pos = buf_skip_forward(b, pos, BUF_CLS_ALNUM, 1);
+    return buf_cursor_set(b, pos);
 }
 
 int buf_backward_word(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, 0, buf_cursor(b), s) || s[1].len)
+    if (!b || !buf_cursor(b))
         return 0;
-
-    ptrdiff_t d;
-    for (d = s->len -1; d >= 0 && !isalnum(s->ptr[d]); --d);
-    for (;d >= 0 && isalnum(s->ptr[d]); --d);
-    return buf_cursor_move(b, d - (s->len -1));
+    pos = buf_skip_backward(b, buf_cursor(b), BUF_CLS_ALNUM, 0);
+    pos = buf_skip_backward(b, pos, BUF_CLS_ALNUM, 1);
+    return buf_cursor_set(b, pos);
 }
 
 int buf_home(Buffer *b)
 {
-    buf_slice s[2];
-
     buf_assert(b);
-    if (!b || !buf_view(b, 0, buf_cursor(b), s) || s[1].len)
+    if (!b || !buf_cursor(b))
         return 0;
-
-    ptrdiff_t d;
-    for (d = s->len -1; d >= 0 && s->ptr[d] != '\n'; --d);
-    return buf_cursor_move(b, d - (s->len -1));
+    return buf_cursor_set(b, buf_skip_backward(b, buf_cursor(b), BUF_CLS_NL, 0));
 }
 
 int buf_end(Buffer *b)
 {
-    buf_slice s[2];
-
     buf_assert(b);
-    if (!b || !buf_view(b, buf_cursor(b), 0, s) || s[1].len)
+    if (!b || buf_cursor(b) == buf_len(b))
         return 0;
-
-    ptrdiff_t d;
-    for (d = 0; d < (ptrdiff_t)s->len && s->ptr[d] != '\n'; ++d);
-    return buf_cursor_move(b, d);
+    return buf_cursor_set(b, buf_skip_forward(b, buf_cursor(b), BUF_CLS_NL, 0));
 }
 
 int buf_kill_word(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, buf_cursor(b), 0, s) || s[1].len)
+    if (!b)
         return 0;
-
-    ptrdiff_t d;
-    for ( d = 0; d < (ptrdiff_t)s->len && !isalnum(s->ptr[d]); ++d);
-    for (;d < (ptrdiff_t)s->len && isalnum(s->ptr[d]); ++d);
-    return buf_delete(b, d);
+    pos = buf_skip_forward(b, buf_cursor(b), BUF_CLS_ALNUM, 0);
+    pos = buf_skip_forward(b, pos, BUF_CLS_ALNUM, 1);
+    return buf_delete(b, pos - buf_cursor(b));
 }
 
 int buf_kill_line(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, buf_cursor(b), 0, s) || s[1].len)
+    if (!b)
         return 0;
-
-    ptrdiff_t d;
-    for (d = 0; d < (ptrdiff_t)s->len && s->ptr[d] != '\n'; ++d);
-    return buf_delete(b, d);
+    pos = buf_skip_forward(b, buf_cursor(b), BUF_CLS_NL, 0);
+    return buf_delete(b, pos - buf_cursor(b));
 }
 
 int buf_line_discard(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, 0, buf_cursor(b), s) || s[1].len)
+    if (!b)
         return 0;
-
-    ptrdiff_t d;
-    for (d = s->len -1; d >= 0 && s->ptr[d] != '\n'; --d);
-    return buf_delete(b, d - (s->len -1));
+    pos = buf_skip_backward(b, buf_cursor(b), BUF_CLS_NL, 0);
+    return buf_delete(b, -(ptrdiff_t)(buf_cursor(b) - pos));
 }
 
 int buf_word_rubout(Buffer *b)
 {
-    buf_slice s[2];
+    size_t pos;
 
     buf_assert(b);
-    if (!b || !buf_view(b, 0, buf_cursor(b), s) || s[1].len)
+    if (!b)
         return 0;
-
-    ptrdiff_t d;
-    for (d = s->len -1; d >= 0 && isspace(s->ptr[d]); --d);
-    for (;d >= 0 && !isspace(s->ptr[d]); --d);
-    return buf_delete(b, d - (s->len -1));
+    pos = buf_skip_backward(b, buf_cursor(b), BUF_CLS_SPACE, 1);
+    pos = buf_skip_backward(b, pos, BUF_CLS_SPACE, 0);
+    return buf_delete(b, -(ptrdiff_t)(buf_cursor(b) - pos));
 }
 #endif /* USE_EXTENTION */
 
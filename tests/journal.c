@@ -0,0 +1,52 @@
+/* Edits logged to the journal come back on replay. Built with -std=c99,
+ * where the POSIX calls the journal makes are only declared through the
+ * feature macros gbf.h sets, so it has to come first. */
+
+#include "../gbf.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(void)
+{
+    char path[] = "/tmp/gbf-journal-XXXXXX";
+    char log[sizeof(path) + 4];
+    const char *want = ">> hello";
+    Buffer b;
+    uint8_t *text;
+    int fd, ok;
+
+    if ((fd = mkstemp(path)) < 0)
+        return 1;
+    close(fd);
+    unlink(path);
+    snprintf(log, sizeof(log), "%s.log", path);
+    if ((fd = open(log, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+        return 1;
+
+    buf_new(&b);
+    ok = buf_journal_replay(&b, path, fd, NULL)
+        && buf_cat(&b, (const uint8_t *)"hello world", 11)
+        && buf_cursor_set(&b, 5) && buf_delete(&b, 6)
+        && buf_insert(&b, 0, (const uint8_t *)">> ", 3)
+        && buf_journal_close(&b);
+    buf_free(&b);
+
+    /* the base file was never written: the text is all in the log */
+    buf_new(&b);
+    ok = ok && buf_journal_replay(&b, path, fd, NULL);
+    text = ok ? buf_flatten(&b) : NULL;
+    if (!text || buf_len(&b) != strlen(want) || memcmp(text, want, strlen(want))) {
+        fprintf(stderr, "journal: replay gave \"%s\", want \"%s\"\n",
+                text ? (const char *)text : "(failed)", want);
+        ok = 0;
+    }
+    free(text);
+    buf_journal_close(&b);
+    buf_free(&b);
+    close(fd);
+    unlink(log);
+    return !ok;
+}
@@ -0,0 +1,631 @@
+/* Random edits made both to a Buffer and to a flat copy of its text;
+ * after each one, every way of reading the buffer must agree with the
+ * copy. make test builds it over the gap, with the options chunks do
+ * not support, and over chunks of 8 and 64 bytes, where a few hundred
+ * bytes already span many chunks.
+ *   tests/model [steps [seed]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../gbf.h"
+
+#define MAX_TEXT 4096 /* edits only delete once near it */
+#define MAX_EDIT 64
+
+static uint8_t text[MAX_TEXT];
+static size_t len;
+static int step;
+static unsigned long long seed = 88172645463325252ULL;
+
+static unsigned rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (unsigned)seed;
+}
+
+/* 0 to n, inclusive */
+static size_t rnd_upto(size_t n)
+{
+    return rnd() % (n + 1);
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "model: step %d: %s\n", step, what);
+    exit(1);
+}
+
+#define CHECK(cond, what) \
+    do { if (!(cond)) fail(what); } while (0)
+
+/* letters, newlines and 2 to 4 byte UTF-8; edits cutting through the
+ * latter leave stray continuation bytes behind */
+static size_t gen(uint8_t *s)
+{
+    size_t n, i;
+
+    n = 1 + (rnd() % 8 ? rnd() % 8 : rnd() % MAX_EDIT);
+    for (i = 0; i < n; ++i) {
+        switch (rnd() % 8) {
+        case 0: s[i] = '\n'; break;
+        case 1: if (i + 2 <= n) { memcpy(s + i, "\xc3\xa9", 2); i += 1; break; } /* fallthrough */
+        case 2: if (i + 3 <= n) { memcpy(s + i, "\xe2\x82\xac", 3); i += 2; break; } /* fallthrough */
+        case 3: if (i + 4 <= n) { memcpy(s + i, "\xf0\x9f\x98\x80", 4); i += 3; break; } /* fallthrough */
+        default: s[i] = "abcab"[rnd() % 5];
+        }
+    }
+    return n;
+}
+
+#ifdef BUF_USE_MARKS
+static struct {
+    size_t id;
+    size_t pos;
+    int sticky;
+    int live;
+} marks[16];
+#endif
+
+/* text inserted at a marker goes before a right-sticky one */
+static void ref_insert(size_t pos, const uint8_t *s, size_t n)
+{
+#ifdef BUF_USE_MARKS
+    size_t i;
+
+    for (i = 0; i < sizeof(marks) / sizeof(*marks); ++i)
+        if (marks[i].pos > pos || (marks[i].pos == pos && marks[i].sticky == BUF_MARK_RIGHT))
+            marks[i].pos += n;
+#endif
+    memmove(text + pos + n, text + pos, len - pos);
+    memcpy(text + pos, s, n);
+    len += n;
+}
+
+/* markers in a deleted span end up at its start */
+static void ref_delete(size_t pos, size_t n)
+{
+#ifdef BUF_USE_MARKS
+    size_t i;
+
+    for (i = 0; i < sizeof(marks) / sizeof(*marks); ++i)
+        if (marks[i].pos > pos)
+            marks[i].pos = marks[i].pos > pos + n ? marks[i].pos - n : pos;
+#endif
+    memmove(text + pos, text + pos + n, len - pos - n);
+    len -= n;
+}
+
+#ifdef BUF_USE_UNDO
+/* Each edit is sealed into an undo step of its own; undoing one applies
+ * the inverse of the op recorded for it. */
+typedef struct {
+    size_t pos;
+    size_t n;
+    int del;
+    uint8_t s[MAX_EDIT];
+} op;
+
+static op ops[1 << 12];
+static size_t nops, top; /* ops[0, top) are done, [top, nops) undone */
+
+static void undo_record(Buffer *b, size_t pos, const uint8_t *s, size_t n, int del)
+{
+    buf_undo_seal(b);
+    if (top == sizeof(ops) / sizeof(*ops)) {
+        buf_undo_clear(b);
+        top = nops = 0;
+        return;
+    }
+    ops[top].pos = pos;
+    ops[top].n = n;
+    ops[top].del = del;
+    memcpy(ops[top].s, s, n);
+    nops = ++top;
+}
+
+/* an undo or a redo, one step in four; 0 if neither */
+static int undo_redo(Buffer *b)
+{
+    op *o;
+
+    switch (rnd() % 8) {
+    case 0:
+        CHECK(buf_undo(b) == (top > 0), "buf_undo");
+        if (!top)
+            return 1;
+        o = &ops[--top];
+        if (o->del)
+            ref_insert(o->pos, o->s, o->n);
+        else
+            ref_delete(o->pos, o->n);
+        return 1;
+    case 1:
+        CHECK(buf_redo(b) == (top < nops), "buf_redo");
+        if (top == nops)
+            return 1;
+        o = &ops[top++];
+        if (o->del)
+            ref_delete(o->pos, o->n);
+        else
+            ref_insert(o->pos, o->s, o->n);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+static void edit(Buffer *b)
+{
+    uint8_t s[MAX_EDIT];
+    size_t pos, n;
+
+    pos = rnd_upto(len);
+    if (len > MAX_TEXT - MAX_EDIT || (len && rnd() % 8 < 3)) {
+        n = rnd() % 4 ? 1 + rnd() % 8 : 1 + rnd() % MAX_EDIT;
+        if (pos == len)
+            --pos;
+        if (n > len - pos)
+            n = len - pos;
+        /* forward from pos, or backward from its end */
+        if (rnd() % 2)
+            CHECK(buf_cursor_set(b, pos) && buf_delete(b, (ptrdiff_t)n), "delete");
+        else
+            CHECK(buf_cursor_set(b, pos + n) && buf_delete(b, -(ptrdiff_t)n), "backspace");
+#ifdef BUF_USE_UNDO
+        undo_record(b, pos, text + pos, n, 1);
+#endif
+        ref_delete(pos, n);
+    } else {
+        n = gen(s);
+        CHECK(buf_insert(b, pos, s, n), "insert");
+#ifdef BUF_USE_UNDO
+        undo_record(b, pos, s, n, 0);
+#endif
+        ref_insert(pos, s, n);
+    }
+}
+
+#if defined(BUF_USE_OBSERVE) || defined(BUF_USE_DAMAGE)
+/* Bring an older copy of the text up to date from a change alone,
+ * reading the inserted bytes from b. */
+static void replay(uint8_t *copy, size_t *n, const Buffer *b, const buf_change *c)
+{
+    CHECK(c->start + c->removed <= *n && *n - c->removed + c->inserted == buf_len(b), "change out of range");
+    memmove(copy + c->start + c->inserted, copy + c->start + c->removed, *n - c->start - c->removed);
+    CHECK(buf_read(b, c->start, copy + c->start, c->inserted) == c->inserted, "change past the end");
+    *n += c->inserted - c->removed;
+}
+#endif
+
+#ifdef BUF_USE_OBSERVE
+static uint8_t shadow[MAX_TEXT];
+static size_t shadow_len;
+static int notes; /* notifications since the last check */
+
+static void observe(void *ctx, const Buffer *b, const buf_change *c)
+{
+    (void)ctx;
+    replay(shadow, &shadow_len, b, c);
+    ++notes;
+}
+#endif
+
+#ifdef BUF_USE_DAMAGE
+static uint8_t base[MAX_TEXT]; /* the text at the last take */
+static size_t base_len;
+
+static void check_damage(Buffer *b)
+{
+    buf_change c;
+
+    if (buf_damage_take(b, &c))
+        replay(base, &base_len, b, &c);
+    CHECK(base_len == len && !memcmp(base, text, len), "buf_damage_take");
+    CHECK(!buf_damage_take(b, &c), "buf_damage_take twice");
+}
+#endif
+
+/* one step: an edit, an undo or a redo, or a batch of edits */
+static void change(Buffer *b)
+{
+#ifdef BUF_USE_UNDO
+    if (undo_redo(b))
+        return;
+#endif
+#ifdef BUF_USE_OBSERVE
+    if (rnd() % 16 == 0) {
+        buf_batch_begin(b);
+        edit(b);
+        buf_batch_begin(b);
+        edit(b);
+        buf_batch_end(b);
+        CHECK(!notes, "nested buf_batch_end");
+        edit(b);
+        buf_batch_end(b);
+        CHECK(notes == 1, "buf_batch_end");
+        return;
+    }
+#endif
+    edit(b);
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_text(const Buffer *b)
+{
+    uint8_t out[MAX_TEXT], *flat;
+    buf_slice v[2], s;
+    buf_iter it;
+    size_t pos, n, k;
+
+    CHECK(buf_len(b) == len, "buf_len");
+    flat = buf_flatten(b);
+    CHECK(flat && !memcmp(flat, text, len) && !flat[len], "buf_flatten");
+    free(flat);
+
+    CHECK(buf_view(b, len, 1, v) == 0, "buf_view past the end");
+    if (!len)
+        return;
+
+    /* n == 0 reaches the end */
+    pos = rnd() % len;
+    n = rnd() % 4 ? rnd_upto(len - pos) : 0;
+    k = buf_view(b, pos, n, v);
+    n = n ? n : len - pos;
+    CHECK(k == n && v[0].len + v[1].len == n, "buf_view length");
+    CHECK(!memcmp(v[0].ptr, text + pos, v[0].len)
+          && (!v[1].len || !memcmp(v[1].ptr, text + pos + v[0].len, v[1].len)), "buf_view");
+
+    for (k = 0, buf_iter_init(&it, b, pos, n); buf_iter_next(&it, &s); k += s.len)
+        CHECK(k + s.len <= n && !memcmp(s.ptr, text + pos + k, s.len), "buf_iter");
+    CHECK(k == n, "buf_iter length");
+
+    CHECK(buf_read(b, pos, out, n) == n && !memcmp(out, text + pos, n), "buf_read");
+    CHECK(buf_read(b, len, out, 1) == 0, "buf_read past the end");
+}
+
+/* patterns cut from the text, and now and then made up */
+static void check_find(const Buffer *b)
+{
+    uint8_t pat[MAX_EDIT];
+    buf_pattern p;
+    size_t n, at, from, want, i;
+
+    n = 1 + (rnd() % 4 ? rnd() % 4 : rnd() % MAX_EDIT);
+    if (len >= n && rnd() % 4)
+        memcpy(pat, text + rnd_upto(len - n), n);
+    else
+        for (i = 0; i < n; ++i)
+            pat[i] = "ab\n"[rnd() % 3];
+    buf_pattern_init(&p, pat, n);
+
+    from = rnd_upto(len);
+    for (want = BUF_NPOS, at = from; at + n <= len; ++at)
+        if (!memcmp(text + at, pat, n)) {
+            want = at;
+            break;
+        }
+    CHECK(buf_find(b, &p, from) == want, "buf_find");
+
+    /* ending at or before from */
+    for (want = BUF_NPOS, at = from + 1; at-- > 0;)
+        if (at + n <= from && !memcmp(text + at, pat, n)) {
+            want = at;
+            break;
+        }
+    CHECK(buf_rfind(b, &p, from) == want, "buf_rfind");
+}
+
+static size_t line_start(size_t pos)
+{
+    for (; pos && text[pos - 1] != '\n'; --pos);
+    return pos;
+}
+
+static size_t line_end(size_t pos)
+{
+    for (; pos < len && text[pos] != '\n'; ++pos);
+    return pos;
+}
+
+/* walk both ways from a random line, one step at a time */
+static void check_line_iter(const Buffer *b)
+{
+    buf_line_iter it;
+    buf_slice v[2];
+    size_t pos, next, prev, start, end, got, i;
+
+    pos = rnd_upto(len);
+    buf_line_iter_init(&it, b, pos);
+    next = line_start(pos);
+    prev = line_end(pos);
+    for (i = 0; i < 16; ++i) {
+        if (rnd() % 2) {
+            got = buf_line_next(&it, v);
+            if ((start = next) != BUF_NPOS) {
+                end = line_end(start);
+                next = end < len ? end + 1 : BUF_NPOS;
+            }
+        } else {
+            got = buf_line_prev(&it, v);
+            if ((end = prev) != BUF_NPOS) {
+                start = line_start(end);
+                prev = start ? start - 1 : BUF_NPOS;
+            } else {
+                start = BUF_NPOS;
+            }
+        }
+        CHECK(got == start, "buf_line_next/prev offset");
+        if (got == BUF_NPOS)
+            continue;
+        CHECK(v[0].len + v[1].len == end - start && !memcmp(v[0].ptr, text + start, v[0].len)
+              && (!v[1].len || !memcmp(v[1].ptr, text + start + v[0].len, v[1].len)), "buf_line_next/prev");
+    }
+}
+
+#ifdef BUF_USE_SNAPSHOT
+/* snapshots taken along the way, each with a copy of the text then */
+static struct {
+    const Buffer *b;
+    uint8_t *text;
+    size_t len;
+} snaps[4];
+
+static void snapshot(Buffer *b)
+{
+    size_t i;
+
+    i = rnd() % (sizeof(snaps) / sizeof(*snaps));
+    if (snaps[i].b) {
+        buf_snapshot_release(snaps[i].b);
+        free(snaps[i].text);
+    }
+    CHECK(snaps[i].b = buf_snapshot(b), "buf_snapshot");
+    CHECK(snaps[i].text = malloc(len + 1), "malloc");
+    memcpy(snaps[i].text, text, len);
+    snaps[i].len = len;
+}
+
+/* later edits must not show through */
+static void check_snapshots(void)
+{
+    buf_iter it;
+    buf_slice s;
+    size_t i, k;
+
+    for (i = 0; i < sizeof(snaps) / sizeof(*snaps); ++i) {
+        if (!snaps[i].b)
+            continue;
+        CHECK(buf_len(snaps[i].b) == snaps[i].len, "snapshot length");
+        for (k = 0, buf_iter_init(&it, snaps[i].b, 0, 0); buf_iter_next(&it, &s); k += s.len)
+            CHECK(k + s.len <= snaps[i].len && !memcmp(s.ptr, snaps[i].text + k, s.len), "snapshot");
+        CHECK(k == snaps[i].len, "snapshot length");
+    }
+}
+
+static void release_snapshots(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(snaps) / sizeof(*snaps); ++i) {
+        if (snaps[i].b)
+            buf_snapshot_release(snaps[i].b);
+        free(snaps[i].text);
+    }
+}
+#endif
+
+#ifdef BUF_USE_MARKS
+/* add, move or drop a marker */
+static void mark(Buffer *b)
+{
+    size_t i, pos;
+
+    i = rnd() % (sizeof(marks) / sizeof(*marks));
+    pos = rnd_upto(len);
+    if (!marks[i].live) {
+        marks[i].sticky = rnd() % 2 ? BUF_MARK_RIGHT : BUF_MARK_LEFT;
+        CHECK((marks[i].id = buf_mark_new(b, pos, marks[i].sticky)) != BUF_NPOS, "buf_mark_new");
+        marks[i].pos = pos;
+        marks[i].live = 1;
+    } else if (rnd() % 4) {
+        CHECK(buf_mark_set(b, marks[i].id, pos), "buf_mark_set");
+        marks[i].pos = pos;
+    } else {
+        buf_mark_free(b, marks[i].id);
+        CHECK(buf_mark_get(b, marks[i].id) == BUF_NPOS, "buf_mark_free");
+        marks[i].live = 0;
+    }
+}
+
+static void check_marks(const Buffer *b)
+{
+    size_t out[sizeof(marks) / sizeof(*marks)];
+    size_t from, to, n, i, k, want;
+
+    for (i = 0; i < sizeof(marks) / sizeof(*marks); ++i)
+        if (marks[i].live)
+            CHECK(buf_mark_get(b, marks[i].id) == marks[i].pos, "buf_mark_get");
+
+    /* the ids in [from, to), in offset order */
+    from = rnd_upto(len);
+    to = from + rnd_upto(len + 1 - from);
+    n = buf_mark_range(b, from, to, out, sizeof(out) / sizeof(*out));
+    for (want = 0, i = 0; i < sizeof(marks) / sizeof(*marks); ++i)
+        want += marks[i].live && marks[i].pos >= from && marks[i].pos < to;
+    CHECK(n == want, "buf_mark_range count");
+    for (k = 0; k < n; ++k) {
+        for (i = 0; i < sizeof(marks) / sizeof(*marks); ++i)
+            if (marks[i].live && marks[i].id == out[k])
+                break;
+        CHECK(i < sizeof(marks) / sizeof(*marks) && marks[i].pos >= from && marks[i].pos < to
+              && (!k || buf_mark_get(b, out[k - 1]) <= marks[i].pos), "buf_mark_range");
+    }
+}
+#endif
+
+#ifdef BUF_USE_LINES
+static void check_lines(const Buffer *b)
+{
+    size_t line, pos, i, k, want;
+
+    for (line = 1, pos = 0; pos < len; ++pos) {
+        if (text[pos] != '\n')
+            continue;
+        CHECK(buf_line_to_offset(b, line) == pos + 1, "buf_line_to_offset");
+        ++line;
+    }
+    CHECK(buf_line_count(b) == line, "buf_line_count");
+    CHECK(buf_line_to_offset(b, 0) == 0, "buf_line_to_offset(0)");
+    CHECK(buf_line_to_offset(b, line) == len, "buf_line_to_offset past the end");
+
+    /* the line of pos counts the newlines before it */
+    for (i = 0; i < 8; ++i) {
+        pos = rnd_upto(len);
+        for (want = 0, k = 0; k < pos; ++k)
+            want += text[k] == '\n';
+        CHECK(buf_offset_to_line(b, pos) == want, "buf_offset_to_line");
+    }
+}
+#endif
+
+#ifdef BUF_USE_UTF8
+/* every byte but a continuation byte starts a codepoint */
+static int cp_start(size_t pos)
+{
+    return (text[pos] & 0xc0) != 0x80;
+}
+
+static size_t ref_next_cp(size_t pos)
+{
+    if (pos >= len)
+        return len;
+    for (++pos; pos < len && !cp_start(pos); ++pos);
+    return pos;
+}
+
+static size_t ref_prev_cp(size_t pos)
+{
+    if (!pos)
+        return 0;
+    for (--pos; pos && !cp_start(pos); --pos);
+    return pos;
+}
+
+static void check_utf8(Buffer *b)
+{
+    size_t pos, cp, total, i, k, want;
+    ptrdiff_t n;
+    int ok;
+
+    for (total = 0, pos = 0; pos < len; ++pos)
+        total += cp_start(pos);
+    CHECK(buf_cp_count(b) == total, "buf_cp_count");
+    CHECK(buf_cp_to_offset(b, total) == len, "buf_cp_to_offset past the end");
+    CHECK(buf_offset_to_cp(b, len) == total, "buf_offset_to_cp at the end");
+
+    for (i = 0; i < 8; ++i) {
+        pos = rnd_upto(len);
+        for (cp = 0, k = 0; k < pos; ++k)
+            cp += cp_start(k);
+        CHECK(buf_offset_to_cp(b, pos) == cp, "buf_offset_to_cp");
+        for (want = pos; want < len && !cp_start(want); ++want);
+        CHECK(buf_cp_to_offset(b, cp) == want, "buf_cp_to_offset");
+        CHECK(buf_next_cp(b, pos) == ref_next_cp(pos), "buf_next_cp");
+        CHECK(buf_prev_cp(b, pos) == ref_prev_cp(pos), "buf_prev_cp");
+
+        /* a motion short of codepoints fails and stays put */
+        n = (ptrdiff_t)(rnd() % 7) - 3;
+        for (want = pos, k = 0; k < (size_t)(n < 0 ? -n : n); ++k, want = cp)
+            if ((cp = n < 0 ? ref_prev_cp(want) : ref_next_cp(want)) == want)
+                break;
+        ok = k == (size_t)(n < 0 ? -n : n);
+        CHECK(buf_cursor_set(b, pos) && buf_cursor_move_cp(b, n) == ok
+              && buf_cursor(b) == (ok ? want : pos), "buf_cursor_move_cp");
+    }
+}
+#endif
+
+#ifdef BUF_USE_FREEZE
+/* Left frozen for the next step's edit to thaw; until then the lengths
+ * and the indexes stay available. */
+static void freeze(Buffer *b)
+{
+    size_t pos, n;
+
+    if (!buf_freeze(b)) {
+        CHECK(!buf_frozen(b), "buf_freeze failed");
+        return;
+    }
+    CHECK(buf_frozen(b) && buf_len(b) == len, "buf_freeze");
+#ifdef BUF_USE_LINES
+    for (n = 1, pos = 0; pos < len; ++pos)
+        n += text[pos] == '\n';
+    CHECK(buf_line_count(b) == n, "buf_line_count while frozen");
+#endif
+#ifdef BUF_USE_UTF8
+    for (n = 0, pos = 0; pos < len; ++pos)
+        n += cp_start(pos);
+    CHECK(buf_cp_count(b) == n, "buf_cp_count while frozen");
+#endif
+    CHECK(buf_frozen(b), "thawed by a length");
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    int steps = argc > 1 ? atoi(argv[1]) : 4000;
+    Buffer b;
+
+    if (argc > 2)
+        seed += strtoull(argv[2], NULL, 10) * 2654435761ULL;
+    buf_new(&b);
+#ifdef BUF_USE_OBSERVE
+    CHECK(buf_observe(&b, observe, NULL), "buf_observe");
+#endif
+    for (step = 0; step < steps; ++step) {
+        change(&b);
+        check_text(&b);
+        check_find(&b);
+        check_line_iter(&b);
+#ifdef BUF_USE_OBSERVE
+        CHECK(notes <= 1 && shadow_len == len && !memcmp(shadow, text, len), "observer");
+        notes = 0;
+#endif
+#ifdef BUF_USE_DAMAGE
+        if (rnd() % 4 == 0)
+            check_damage(&b);
+#endif
+#ifdef BUF_USE_MARKS
+        if (rnd() % 8 == 0)
+            mark(&b);
+        check_marks(&b);
+#endif
+#ifdef BUF_USE_SNAPSHOT
+        if (rnd() % 16 == 0)
+            snapshot(&b);
+        check_snapshots();
+#endif
+#ifdef BUF_USE_FREEZE
+        CHECK(!buf_frozen(&b), "buf_thaw");
+#endif
+#ifdef BUF_USE_LINES
+        check_lines(&b);
+#endif
+#ifdef BUF_USE_UTF8
+        check_utf8(&b);
+#endif
+#ifdef BUF_USE_FREEZE
+        if (rnd() % 16 == 0)
+            freeze(&b);
+#endif
+    }
+#ifdef BUF_USE_SNAPSHOT
+    release_snapshots();
+#endif
+    buf_free(&b);
+    return 0;
+}
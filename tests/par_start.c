@@ -0,0 +1,30 @@
+/* A scan issued right after the pool starts must not hang: the workers
+ * may not have run yet when the job is posted. Run under a timeout. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../gbf.h"
+
+int main(void)
+{
+    static uint8_t text[1 << 20];
+    Buffer b;
+    size_t want, got;
+    int i;
+
+    for (i = 0; i < (int)sizeof(text); ++i)
+        text[i] = i % 64 == 63 ? '\n' : 'a';
+    want = sizeof(text) / 64;
+    buf_new(&b);
+    buf_cat(&b, text, sizeof(text));
+    for (i = 0; i < 200; ++i) {
+        buf_par_threads(2 + i % 3);
+        if ((got = buf_par_count_byte(&b, '\n')) != want) {
+            fprintf(stderr, "par_start: run %d counted %zu, want %zu\n", i, got, want);
+            return 1;
+        }
+    }
+    buf_free(&b);
+    return 0;
+}